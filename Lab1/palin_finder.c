@@ -0,0 +1,1311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Bytes up to and including this value are whitespace and skipped
+#define WHITESPACE 32
+// Bytes below this value are "upper case" and have 32 added, just like
+// lower() in palin_finder.py
+#define LOWER_CASE 97
+
+// The widest block a kernel reads from either end at a time
+#define MAX_BLOCK 32
+// Compacted bytes waiting to be compared are bounded by two blocks, plus
+// room for the 8 byte stores of the compaction running past the end
+#define QUEUE_SIZE (4 * MAX_BLOCK)
+
+// Large mappings are scanned in windows of this many bytes from each end.
+// The next window is requested ahead of time and the finished one
+// released, so inputs larger than memory stream through the page cache.
+#define STREAM_WINDOW (64 << 20)
+
+// Size of the generated input used by the benchmark
+#define BENCH_SIZE (256 << 20)
+#define BENCH_RANDOM_CASES 20000
+
+// The search splits the input into chunks of this many bytes, and each
+// chunk is scanned together with this many bytes on either side. Only
+// palindromes longer than the overlap need to look outside the window.
+#define SEARCH_CHUNK (2 << 20)
+#define SEARCH_OVERLAP (256 << 10)
+#define SEARCH_TOP 5
+#define SEARCH_PREVIEW 60
+
+/**
+ * Progress of a check from both ends of the input. Bytes between lo and hi
+ * have not been looked at yet. front holds normalized bytes taken from the
+ * left that are not matched yet, and back the same from the right, in
+ * reverse order. At most one of them is non-empty between blocks.
+ */
+typedef struct
+{
+    size_t lo;
+    size_t hi;
+    unsigned char front[QUEUE_SIZE];
+    unsigned char back[QUEUE_SIZE];
+    size_t front_length;
+    size_t back_length;
+} scan_t;
+
+/**
+ * A kernel advances a scan by whole blocks until at least budget bytes have
+ * been consumed or less than a block is left between the ends. Returns
+ * false as soon as a mismatch is found.
+ */
+typedef bool (*kernel_fn)(scan_t *scan, unsigned char const *data, size_t budget);
+
+typedef struct
+{
+    char const *name;
+    kernel_fn run;
+    size_t block;
+    bool (*supported)(void);
+} kernel_t;
+
+/**
+ * A palindrome found by the search: the bytes [start, end) of the input,
+ * holding length characters once whitespace is skipped
+ */
+typedef struct
+{
+    size_t start;
+    size_t end;
+    size_t length;
+} palindrome_t;
+
+typedef struct
+{
+    palindrome_t *items;
+    size_t count;
+    size_t capacity;
+} palindrome_list_t;
+
+typedef struct
+{
+    unsigned char const *data;
+    size_t size;
+    size_t chunk;
+    size_t overlap;
+    size_t chunk_count;
+    int threads; // Worker threads used, at most one per chunk
+    size_t top;
+    size_t min_length;
+    atomic_size_t next_chunk;
+    // Palindromes of at least min_length, one list per chunk so they can be
+    // printed in input order
+    palindrome_list_t *found;
+} search_t;
+
+/**
+ * A palindrome that reached past the window it was found in, centred on
+ * doubled window index centre: 2i is character i and 2i + 1 is between
+ * characters i and i + 1
+ */
+typedef struct
+{
+    int64_t centre;
+    int64_t length;
+    size_t start;
+    size_t end;
+} extended_t;
+
+/**
+ * State of one search thread. Each window is normalized into text, with
+ * the position of every character relative to the window start, and
+ * Manacher's algorithm fills odd and even with the palindrome radius
+ * around every character.
+ */
+typedef struct
+{
+    search_t *search;
+    unsigned char *text;
+    uint32_t *position;
+    int64_t *odd;
+    int64_t *even;
+    palindrome_t *longest;
+    size_t longest_count;
+    bool failed;
+
+    // The window being searched
+    size_t window_start;
+    int64_t length;
+    int64_t owned_first;
+    int64_t owned_last;
+    bool open_left;
+    bool open_right;
+    // The last palindrome extended past the window, and the one reaching
+    // furthest right, used as mirrors for the ones that follow
+    extended_t recent;
+    extended_t furthest;
+    bool extended;
+} search_worker_t;
+
+// The cases of palin_finder.py
+static char const *PALINDROMES[] = {"level", "8448", "KayAk", "step on no pets", "Never odd or even"};
+static char const *NOT_PALINDROMES[] = {"ad8dF90", "e082 2F01"};
+
+// Normalized value of every byte, or 0 for whitespace
+static unsigned char normalized[256];
+
+static void init_normalized(void)
+{
+    for (int c = 0; c < 256; c++)
+    {
+        if (c <= WHITESPACE)
+            normalized[c] = 0;
+        else
+            normalized[c] = c < LOWER_CASE ? c + 32 : c;
+    }
+}
+
+/**
+ * The reference check, moving one byte at a time from both ends like the
+ * assembly version. Input without any non-whitespace byte is a palindrome.
+ */
+bool is_palindrome_scalar(unsigned char const *data, size_t length)
+{
+    size_t lo = 0;
+    size_t hi = length;
+    while (lo < hi)
+    {
+        unsigned char const left = normalized[data[lo]];
+        if (!left)
+        {
+            lo++;
+            continue;
+        }
+        unsigned char const right = normalized[data[hi - 1]];
+        if (!right)
+        {
+            hi--;
+            continue;
+        }
+        if (left != right)
+            return false;
+        lo++;
+        hi--;
+    }
+    return true;
+}
+
+/**
+ * Checks what is left once the ends are less than a block apart: the
+ * unmatched front bytes, the untouched middle, and the unmatched back
+ * bytes in their original order
+ */
+static bool finish_scan(scan_t const *scan, unsigned char const *data)
+{
+    unsigned char rest[2 * QUEUE_SIZE];
+    size_t length = 0;
+
+    memcpy(rest, scan->front, scan->front_length);
+    length += scan->front_length;
+    for (size_t i = scan->lo; i < scan->hi; i++)
+    {
+        if (normalized[data[i]])
+            rest[length++] = normalized[data[i]];
+    }
+    for (size_t i = scan->back_length; i > 0; i--)
+    {
+        rest[length++] = scan->back[i - 1];
+    }
+
+    for (size_t i = 0; i < length / 2; i++)
+    {
+        if (rest[i] != rest[length - 1 - i])
+            return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Shuffle control moving the kept bytes of 8 to the front, for every mask
+// of kept bytes
+static uint64_t compact_lut[256];
+
+static void init_compact_lut(void)
+{
+    for (int mask = 0; mask < 256; mask++)
+    {
+        uint64_t control = 0;
+        int out = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            if (mask & (1 << i))
+                control |= (uint64_t)i << (8 * out++);
+        }
+        for (; out < 8; out++)
+        {
+            control |= (uint64_t)0x80 << (8 * out);
+        }
+        compact_lut[mask] = control;
+    }
+}
+
+/**
+ * Normalizes 16 bytes and returns the mask of the ones that are not
+ * whitespace. Comparisons are unsigned, as bytes above 127 are letters too.
+ */
+__attribute__((target("sse4.1,ssse3"))) static inline __m128i normalize_sse(__m128i bytes, unsigned int *keep)
+{
+    __m128i const whitespace = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(WHITESPACE)), bytes);
+    __m128i const upper = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(LOWER_CASE - 1)), bytes);
+    *keep = ~_mm_movemask_epi8(whitespace) & 0xFFFF;
+    return _mm_add_epi8(bytes, _mm_and_si128(upper, _mm_set1_epi8(32)));
+}
+
+/**
+ * Stores the kept bytes of 16 at out, and returns how many there were.
+ * May write up to 16 bytes past the kept ones.
+ */
+__attribute__((target("sse4.1,ssse3,popcnt"))) static inline size_t compact_sse(unsigned char *out, __m128i bytes, unsigned int keep)
+{
+    unsigned int const low = keep & 0xFF;
+    unsigned int const high = keep >> 8;
+    __m128i const control = _mm_set_epi64x(compact_lut[high] + 0x0808080808080808ULL, compact_lut[low]);
+    __m128i const packed = _mm_shuffle_epi8(bytes, control);
+    _mm_storel_epi64((__m128i *)out, packed);
+    _mm_storel_epi64((__m128i *)(out + __builtin_popcount(low)), _mm_srli_si128(packed, 8));
+    return __builtin_popcount(keep);
+}
+
+__attribute__((target("sse4.1,ssse3,popcnt"))) static bool kernel_sse(scan_t *scan, unsigned char const *data, size_t budget)
+{
+    __m128i const reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t consumed = 0;
+    while (scan->hi - scan->lo >= 16 && consumed < budget)
+    {
+        unsigned int keep;
+        // Take a block from the end that has fewer bytes queued, so the
+        // queues never hold more than two blocks
+        if (scan->front_length <= scan->back_length)
+        {
+            __m128i bytes = normalize_sse(_mm_loadu_si128((__m128i const *)(data + scan->lo)), &keep);
+            scan->front_length += compact_sse(scan->front + scan->front_length, bytes, keep);
+            scan->lo += 16;
+        }
+        else
+        {
+            scan->hi -= 16;
+            __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + scan->hi)), reverse);
+            bytes = normalize_sse(bytes, &keep);
+            scan->back_length += compact_sse(scan->back + scan->back_length, bytes, keep);
+        }
+        consumed += 16;
+
+        size_t const count = scan->front_length < scan->back_length ? scan->front_length : scan->back_length;
+        for (size_t offset = 0; offset < count; offset += 16)
+        {
+            __m128i const left = _mm_loadu_si128((__m128i const *)(scan->front + offset));
+            __m128i const right = _mm_loadu_si128((__m128i const *)(scan->back + offset));
+            unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(left, right));
+            if (count - offset < 16)
+                equal |= ~0U << (count - offset);
+            if ((equal & 0xFFFF) != 0xFFFF)
+                return false;
+        }
+        // What is left of either queue is less than a block
+        scan->front_length -= count;
+        scan->back_length -= count;
+        _mm_storeu_si128((__m128i *)scan->front, _mm_loadu_si128((__m128i const *)(scan->front + count)));
+        _mm_storeu_si128((__m128i *)(scan->front + 16), _mm_loadu_si128((__m128i const *)(scan->front + count + 16)));
+        _mm_storeu_si128((__m128i *)scan->back, _mm_loadu_si128((__m128i const *)(scan->back + count)));
+        _mm_storeu_si128((__m128i *)(scan->back + 16), _mm_loadu_si128((__m128i const *)(scan->back + count + 16)));
+    }
+    return true;
+}
+
+__attribute__((target("avx2,popcnt"))) static bool kernel_avx2(scan_t *scan, unsigned char const *data, size_t budget)
+{
+    __m256i const reverse = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                            0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m256i const whitespace_max = _mm256_set1_epi8(WHITESPACE);
+    __m256i const upper_max = _mm256_set1_epi8(LOWER_CASE - 1);
+    __m256i const case_offset = _mm256_set1_epi8(32);
+    size_t consumed = 0;
+    while (scan->hi - scan->lo >= 32 && consumed < budget)
+    {
+        bool const from_front = scan->front_length <= scan->back_length;
+        __m256i bytes;
+        if (from_front)
+        {
+            bytes = _mm256_loadu_si256((__m256i const *)(data + scan->lo));
+            scan->lo += 32;
+        }
+        else
+        {
+            scan->hi -= 32;
+            // Reverse the bytes of each lane, then swap the lanes
+            bytes = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *)(data + scan->hi)), reverse);
+            bytes = _mm256_permute4x64_epi64(bytes, 0x4E);
+        }
+        consumed += 32;
+
+        __m256i const whitespace = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, whitespace_max), bytes);
+        __m256i const upper = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, upper_max), bytes);
+        uint32_t const keep = ~(uint32_t)_mm256_movemask_epi8(whitespace);
+        bytes = _mm256_add_epi8(bytes, _mm256_and_si256(upper, case_offset));
+
+        // Compact each lane the same way as the SSE kernel
+        unsigned char *queue = from_front ? scan->front : scan->back;
+        size_t *length = from_front ? &scan->front_length : &scan->back_length;
+        for (int lane = 0; lane < 2; lane++)
+        {
+            __m128i const half = lane ? _mm256_extracti128_si256(bytes, 1) : _mm256_castsi256_si128(bytes);
+            unsigned int const lane_keep = (keep >> (16 * lane)) & 0xFFFF;
+            unsigned int const low = lane_keep & 0xFF;
+            unsigned int const high = lane_keep >> 8;
+            __m128i const control = _mm_set_epi64x(compact_lut[high] + 0x0808080808080808ULL, compact_lut[low]);
+            __m128i const packed = _mm_shuffle_epi8(half, control);
+            _mm_storel_epi64((__m128i *)(queue + *length), packed);
+            _mm_storel_epi64((__m128i *)(queue + *length + __builtin_popcount(low)), _mm_srli_si128(packed, 8));
+            *length += __builtin_popcount(lane_keep);
+        }
+
+        size_t const count = scan->front_length < scan->back_length ? scan->front_length : scan->back_length;
+        for (size_t offset = 0; offset < count; offset += 32)
+        {
+            __m256i const left = _mm256_loadu_si256((__m256i const *)(scan->front + offset));
+            __m256i const right = _mm256_loadu_si256((__m256i const *)(scan->back + offset));
+            uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(left, right));
+            if (count - offset < 32)
+                equal |= ~0U << (count - offset);
+            if (equal != 0xFFFFFFFF)
+                return false;
+        }
+        scan->front_length -= count;
+        scan->back_length -= count;
+        _mm256_storeu_si256((__m256i *)scan->front, _mm256_loadu_si256((__m256i const *)(scan->front + count)));
+        _mm256_storeu_si256((__m256i *)(scan->front + 32), _mm256_loadu_si256((__m256i const *)(scan->front + count + 32)));
+        _mm256_storeu_si256((__m256i *)scan->back, _mm256_loadu_si256((__m256i const *)(scan->back + count)));
+        _mm256_storeu_si256((__m256i *)(scan->back + 32), _mm256_loadu_si256((__m256i const *)(scan->back + count + 32)));
+    }
+    return true;
+}
+
+static bool sse_supported(void)
+{
+    return __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt");
+}
+
+static bool avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+#endif
+
+/**
+ * Kernel moving one byte at a time, for machines without the SIMD kernels.
+ * It matches bytes as soon as it has one from each end, so the queues stay
+ * empty and the last byte is left to finish_scan.
+ */
+static bool kernel_bytes(scan_t *scan, unsigned char const *data, size_t budget)
+{
+    size_t lo = scan->lo;
+    size_t hi = scan->hi;
+    size_t const stop = budget < hi - lo ? lo + budget : hi;
+    while (hi - lo >= 2 && lo < stop)
+    {
+        unsigned char const left = normalized[data[lo]];
+        if (!left)
+        {
+            lo++;
+            continue;
+        }
+        unsigned char const right = normalized[data[hi - 1]];
+        if (!right)
+        {
+            hi--;
+            continue;
+        }
+        if (left != right)
+            return false;
+        lo++;
+        hi--;
+    }
+    scan->lo = lo;
+    scan->hi = hi;
+    return true;
+}
+
+static bool always_supported(void)
+{
+    return true;
+}
+
+static kernel_t const KERNELS[] = {
+#ifdef HAVE_X86_KERNELS
+    {"avx2", kernel_avx2, 32, avx2_supported},
+    {"sse", kernel_sse, 16, sse_supported},
+#endif
+    {"bytes", kernel_bytes, 2, always_supported},
+};
+#define KERNEL_COUNT (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+/**
+ * Returns the fastest kernel the processor supports
+ */
+static kernel_t const *best_kernel(void)
+{
+    for (size_t i = 0; i < KERNEL_COUNT; i++)
+    {
+        if (KERNELS[i].supported())
+            return &KERNELS[i];
+    }
+    return &KERNELS[KERNEL_COUNT - 1];
+}
+
+/**
+ * Releases pages in [from, to) of a mapping, rounded inwards to whole pages
+ */
+static void advise_range(unsigned char const *data, size_t from, size_t to, int advice)
+{
+    size_t const page = sysconf(_SC_PAGESIZE);
+    from = (from + page - 1) / page * page;
+    to = to / page * page;
+    if (from < to)
+        madvise((void *)(data + from), to - from, advice);
+}
+
+/**
+ * Checks the input with the given kernel. For a mapped file, the scan is
+ * done one window at a time from each end, asking the kernel to read the
+ * next windows ahead and to drop the ones that are done.
+ */
+bool is_palindrome(kernel_t const *kernel, unsigned char const *data, size_t length, bool mapped)
+{
+    scan_t scan = {.lo = 0, .hi = length};
+    size_t const window = mapped ? STREAM_WINDOW : SIZE_MAX;
+
+    while (scan.hi - scan.lo >= kernel->block)
+    {
+        if (mapped)
+        {
+            size_t const lo = scan.lo;
+            size_t const hi = scan.hi;
+            advise_range(data, lo, lo + window < hi ? lo + window : hi, MADV_WILLNEED);
+            advise_range(data, hi > lo + window ? hi - window : lo, hi, MADV_WILLNEED);
+        }
+
+        size_t const lo = scan.lo;
+        size_t const hi = scan.hi;
+        if (!kernel->run(&scan, data, window))
+            return false;
+
+        if (mapped)
+        {
+            advise_range(data, lo, scan.lo, MADV_DONTNEED);
+            advise_range(data, scan.hi, hi, MADV_DONTNEED);
+        }
+    }
+    return finish_scan(&scan, data);
+}
+
+static double seconds_since(struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Fills buffer with text whose normalized form is a palindrome, with
+ * random whitespace and case, or with one mismatch if broken is set
+ */
+static void generate_text(unsigned char *buffer, size_t length, uint64_t *state, bool broken)
+{
+    static char const letters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    size_t lo = 0;
+    size_t hi = length;
+    while (hi - lo >= 2)
+    {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        uint64_t const random = *state;
+
+        // Whitespace on either side now and then
+        if ((random & 7) == 0)
+        {
+            buffer[lo++] = " \t\n\r"[(random >> 3) & 3];
+            continue;
+        }
+        if ((random & 7) == 1)
+        {
+            buffer[--hi] = ' ';
+            continue;
+        }
+        char const letter = letters[(random >> 8) % (sizeof(letters) - 1)];
+        buffer[lo++] = (random >> 16) & 1 && letter >= 'a' ? letter - 32 : letter;
+        buffer[--hi] = (random >> 17) & 1 && letter >= 'a' ? letter - 32 : letter;
+    }
+    if (hi > lo)
+        buffer[lo] = 'm';
+
+    if (broken && length)
+    {
+        // Change one letter, keeping it a letter
+        size_t position = (*state >> 11) % length;
+        while (position < length && !normalized[buffer[position]])
+            position++;
+        if (position < length)
+            buffer[position] = buffer[position] == 'q' ? 'z' : 'q';
+    }
+}
+
+/**
+ * Cross-checks every supported kernel against the cases of palin_finder.py
+ * and random inputs, and measures the throughput of each on a large input
+ */
+static int run_benchmark(void)
+{
+    int failures = 0;
+
+    for (size_t k = 0; k < KERNEL_COUNT; k++)
+    {
+        kernel_t const *kernel = &KERNELS[k];
+        if (!kernel->supported())
+        {
+            printf("%-6s not supported by this processor\n", kernel->name);
+            continue;
+        }
+
+        int agreed = 0;
+        int total = 0;
+        for (size_t i = 0; i < sizeof(PALINDROMES) / sizeof(PALINDROMES[0]); i++, total++)
+        {
+            agreed += is_palindrome(kernel, (unsigned char const *)PALINDROMES[i], strlen(PALINDROMES[i]), false);
+        }
+        for (size_t i = 0; i < sizeof(NOT_PALINDROMES) / sizeof(NOT_PALINDROMES[0]); i++, total++)
+        {
+            agreed += !is_palindrome(kernel, (unsigned char const *)NOT_PALINDROMES[i], strlen(NOT_PALINDROMES[i]), false);
+        }
+        printf("%-6s palin_finder.py cases: %d of %d correct\n", kernel->name, agreed, total);
+        failures += total - agreed;
+
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        unsigned char buffer[512];
+        int random_agreed = 0;
+        for (int i = 0; i < BENCH_RANDOM_CASES; i++)
+        {
+            size_t const length = state % sizeof(buffer);
+            generate_text(buffer, length, &state, i & 1);
+            random_agreed += is_palindrome(kernel, buffer, length, false) == is_palindrome_scalar(buffer, length);
+        }
+        printf("%-6s random cases: %d of %d agree with the scalar check\n", kernel->name, random_agreed, BENCH_RANDOM_CASES);
+        failures += BENCH_RANDOM_CASES - random_agreed;
+    }
+
+    unsigned char *text = malloc(BENCH_SIZE);
+    if (!text)
+    {
+        fprintf(stderr, "Could not allocate %d bytes for the benchmark\n", BENCH_SIZE);
+        return 1;
+    }
+    uint64_t state = 42;
+    generate_text(text, BENCH_SIZE, &state, false);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool result = is_palindrome_scalar(text, BENCH_SIZE);
+    double seconds = seconds_since(&start);
+    printf("%-6s %d MiB in %.3f s, %.2f GB/s%s\n", "scalar", BENCH_SIZE >> 20, seconds,
+           BENCH_SIZE / seconds / 1e9, result ? "" : " WRONG RESULT");
+    failures += !result;
+
+    for (size_t k = 0; k < KERNEL_COUNT; k++)
+    {
+        if (!KERNELS[k].supported())
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = is_palindrome(&KERNELS[k], text, BENCH_SIZE, false);
+        seconds = seconds_since(&start);
+        printf("%-6s %d MiB in %.3f s, %.2f GB/s%s\n", KERNELS[k].name, BENCH_SIZE >> 20, seconds,
+               BENCH_SIZE / seconds / 1e9, result ? "" : " WRONG RESULT");
+        failures += !result;
+    }
+
+    free(text);
+    return failures ? 1 : 0;
+}
+
+/**
+ * Maps a whole file read-only. Empty files are returned as a NULL mapping.
+ */
+static bool map_file(char const *path, unsigned char const **data, size_t *length)
+{
+    int const fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    *length = info.st_size;
+    *data = NULL;
+    if (*length)
+    {
+        void *mapping = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        *data = mapping;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * Widens the palindrome [*start, *end) of the input one character pair at
+ * a time for as long as the characters around it match, and returns the
+ * number of pairs added. Used for palindromes reaching past a window.
+ */
+static size_t extend_palindrome(unsigned char const *data, size_t size, size_t *start, size_t *end)
+{
+    size_t pairs = 0;
+    for (;;)
+    {
+        size_t left = *start;
+        while (left > 0 && !normalized[data[left - 1]])
+            left--;
+        size_t right = *end;
+        while (right < size && !normalized[data[right]])
+            right++;
+        if (left == 0 || right == size || normalized[data[left - 1]] != normalized[data[right]])
+            return pairs;
+        *start = left - 1;
+        *end = right + 1;
+        pairs++;
+    }
+}
+
+/**
+ * Orders palindromes longest first, then by where they start
+ */
+static bool longer_palindrome(palindrome_t const *a, palindrome_t const *b)
+{
+    return a->length != b->length ? a->length > b->length : a->start < b->start;
+}
+
+/**
+ * Adds a palindrome to a list of the top longest ones, kept sorted
+ */
+static void insert_longest(palindrome_t *longest, size_t *count, size_t top, palindrome_t const *found)
+{
+    if (*count == top && !longer_palindrome(found, &longest[top - 1]))
+        return;
+
+    size_t i = *count < top ? (*count)++ : top - 1;
+    for (; i > 0 && longer_palindrome(found, &longest[i - 1]); i--)
+    {
+        longest[i] = longest[i - 1];
+    }
+    longest[i] = *found;
+}
+
+static bool append_palindrome(palindrome_list_t *list, palindrome_t const *found)
+{
+    if (list->count == list->capacity)
+    {
+        size_t const capacity = list->capacity ? 2 * list->capacity : 64;
+        palindrome_t *items = realloc(list->items, capacity * sizeof(palindrome_t));
+        if (!items)
+            return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = *found;
+    return true;
+}
+
+/**
+ * Fills odd[i] with the number of characters k such that text[i - k + 1]
+ * to text[i + k - 1] is a palindrome, and even[i] with the k such that
+ * text[i - k] to text[i + k - 1] is, in linear time
+ */
+static void find_radii(unsigned char const *text, int64_t length, int64_t *odd, int64_t *even)
+{
+    int64_t left = 0;
+    int64_t right = -1;
+    for (int64_t i = 0; i < length; i++)
+    {
+        int64_t k = i > right ? 1 : odd[left + right - i];
+        if (i <= right && k > right - i + 1)
+            k = right - i + 1;
+        while (i - k >= 0 && i + k < length && text[i - k] == text[i + k])
+            k++;
+        odd[i] = k;
+        if (i + k - 1 > right)
+        {
+            left = i - k + 1;
+            right = i + k - 1;
+        }
+    }
+
+    left = 0;
+    right = -1;
+    for (int64_t i = 0; i < length; i++)
+    {
+        int64_t k = i > right ? 0 : even[left + right - i + 1];
+        if (i <= right && k > right - i + 1)
+            k = right - i + 1;
+        while (i - k - 1 >= 0 && i + k < length && text[i - k - 1] == text[i + k])
+            k++;
+        even[i] = k;
+        if (i + k - 1 > right)
+        {
+            left = i - k;
+            right = i + k - 1;
+        }
+    }
+}
+
+/**
+ * Length of the palindrome around a doubled window index, as far as it is
+ * known. The centre after the last character has nothing to its right.
+ */
+static int64_t centre_length(search_worker_t const *worker, int64_t centre)
+{
+    if (centre % 2 == 0)
+        return 2 * worker->odd[centre / 2] - 1;
+    int64_t const next = (centre + 1) / 2;
+    return next < worker->length ? 2 * worker->even[next] : 0;
+}
+
+static void store_centre_length(search_worker_t *worker, int64_t centre, int64_t length)
+{
+    if (centre % 2 == 0)
+        worker->odd[centre / 2] = (length + 1) / 2;
+    else if ((centre + 1) / 2 < worker->length)
+        worker->even[(centre + 1) / 2] = length / 2;
+}
+
+/**
+ * Whether a palindrome found in the window runs into an edge of the window
+ * that is not an end of the input, so it may continue outside
+ */
+static bool reaches_edge(search_worker_t const *worker, int64_t centre, int64_t length)
+{
+    if (length == 0)
+        return worker->open_right && centre == 2 * worker->length - 1;
+    return (worker->open_left && (centre - length + 1) / 2 == 0) ||
+           (worker->open_right && (centre + length - 1) / 2 == worker->length - 1);
+}
+
+/**
+ * Moves from the character at offset to the one steps characters further
+ * on, or back for negative steps, skipping whitespace
+ */
+static size_t move_offset(unsigned char const *data, size_t offset, int64_t steps)
+{
+    for (; steps > 0; steps--)
+    {
+        do
+            offset++;
+        while (!normalized[data[offset]]);
+    }
+    for (; steps < 0; steps++)
+    {
+        do
+            offset--;
+        while (!normalized[data[offset]]);
+    }
+    return offset;
+}
+
+/**
+ * Offset in the input of a character given by its window index, which may
+ * lie outside the window. Those are found by moving from the nearest
+ * character whose offset is known: the window edges and the ends of the
+ * palindromes kept as mirrors.
+ */
+static size_t character_offset(search_worker_t const *worker, int64_t index)
+{
+    if (index >= 0 && index < worker->length)
+        return worker->window_start + worker->position[index];
+
+    int64_t anchors[6] = {0, worker->length - 1};
+    size_t offsets[6] = {worker->window_start + worker->position[0], worker->window_start + worker->position[worker->length - 1]};
+    int count = 2;
+    extended_t const *mirrors[] = {&worker->recent, &worker->furthest};
+    for (int i = 0; worker->extended && i < 2; i++)
+    {
+        if (!mirrors[i]->length)
+            continue;
+        anchors[count] = (mirrors[i]->centre - mirrors[i]->length + 1) / 2;
+        offsets[count++] = mirrors[i]->start;
+        anchors[count] = (mirrors[i]->centre + mirrors[i]->length - 1) / 2;
+        offsets[count++] = mirrors[i]->end - 1;
+    }
+
+    int nearest = 0;
+    for (int i = 1; i < count; i++)
+    {
+        if (llabs(index - anchors[i]) < llabs(index - anchors[nearest]))
+            nearest = i;
+    }
+    return move_offset(worker->search->data, offsets[nearest], index - anchors[nearest]);
+}
+
+/**
+ * Finds the full length of a palindrome that runs into an edge of the
+ * window. Where it lies inside an earlier palindrome that was extended,
+ * the palindrome around the mirrored centre gives its length or a lower
+ * bound, just as in Manacher's algorithm, so periodic text does not
+ * compare the same stretch of input over and over. Anything beyond that
+ * is compared directly.
+ */
+static palindrome_t extend_centre(search_worker_t *worker, int64_t centre, int64_t length)
+{
+    search_t const *search = worker->search;
+    bool exact = false;
+    extended_t const *mirrors[] = {&worker->recent, &worker->furthest};
+    for (int i = 0; worker->extended && i < 2 && !exact; i++)
+    {
+        int64_t const room = mirrors[i]->centre + mirrors[i]->length - centre;
+        int64_t const mirror = 2 * mirrors[i]->centre - centre;
+        if (room <= 0 || mirror < 0)
+            continue;
+
+        // Centres from the start of the chunk up to this one are final,
+        // others are only known if they stay inside the window
+        int64_t const mirror_length = centre_length(worker, mirror);
+        bool const mirror_exact = mirror >= 2 * worker->owned_first || !reaches_edge(worker, mirror, mirror_length);
+        int64_t const bound = mirror_length < room ? mirror_length : room;
+        if (mirror_exact && mirror_length != room)
+        {
+            length = bound;
+            exact = true;
+        }
+        else if (bound > length)
+        {
+            length = bound;
+        }
+    }
+
+    palindrome_t found = {.length = length};
+    if (length)
+    {
+        found.start = character_offset(worker, (centre - length + 1) / 2);
+        found.end = character_offset(worker, (centre + length - 1) / 2) + 1;
+    }
+    else
+    {
+        found.start = found.end = character_offset(worker, (centre - 1) / 2) + 1;
+    }
+    if (!exact)
+        found.length += 2 * extend_palindrome(search->data, search->size, &found.start, &found.end);
+
+    extended_t const extended = {centre, found.length, found.start, found.end};
+    store_centre_length(worker, centre, found.length);
+    worker->recent = extended;
+    if (!worker->extended || centre + (int64_t)found.length > worker->furthest.centre + worker->furthest.length)
+        worker->furthest = extended;
+    worker->extended = true;
+    return found;
+}
+
+/**
+ * Whether a palindrome of this length would be listed, so that it is worth
+ * finding where it is
+ */
+static bool reportable(search_worker_t const *worker, size_t length)
+{
+    search_t const *search = worker->search;
+    if (!length)
+        return false;
+    if (search->min_length && length >= search->min_length)
+        return true;
+    return worker->longest_count < search->top || length >= worker->longest[search->top - 1].length;
+}
+
+/**
+ * Records the palindrome [start, end) centred on a character owned by the
+ * chunk being searched
+ */
+static bool report_palindrome(search_worker_t *worker, size_t chunk, palindrome_t const *found)
+{
+    search_t *search = worker->search;
+    insert_longest(worker->longest, &worker->longest_count, search->top, found);
+    if (search->min_length && found->length >= search->min_length)
+        return append_palindrome(&search->found[chunk], found);
+    return true;
+}
+
+/**
+ * Finds the longest palindrome around every character in one chunk of the
+ * input, and between every character and the next. The window searched
+ * reaches overlap bytes into the neighbouring chunks, so only palindromes
+ * longer than that need to look outside it.
+ */
+static bool search_chunk(search_worker_t *worker, size_t chunk)
+{
+    search_t const *search = worker->search;
+    unsigned char const *data = search->data;
+    size_t const size = search->size;
+    size_t const first = chunk * search->chunk;
+    size_t const last = first + search->chunk < size ? first + search->chunk : size;
+    worker->window_start = first > search->overlap ? first - search->overlap : 0;
+    size_t const window_end = size - last > search->overlap ? last + search->overlap : size;
+    worker->open_left = worker->window_start > 0;
+    worker->open_right = window_end < size;
+    worker->extended = false;
+
+    // Normalize the window, noting which characters belong to this chunk
+    int64_t length = 0;
+    worker->owned_first = -1;
+    worker->owned_last = -1;
+    for (size_t i = worker->window_start; i < window_end; i++)
+    {
+        if (i == first)
+            worker->owned_first = length;
+        if (i == last)
+            worker->owned_last = length;
+        unsigned char const value = normalized[data[i]];
+        worker->text[length] = value;
+        worker->position[length] = i - worker->window_start;
+        length += value != 0;
+    }
+    if (worker->owned_last == -1)
+        worker->owned_last = length;
+    worker->length = length;
+
+    find_radii(worker->text, length, worker->odd, worker->even);
+
+    for (int64_t centre = 2 * worker->owned_first; centre < 2 * worker->owned_last; centre++)
+    {
+        int64_t const centre_length_found = centre_length(worker, centre);
+        palindrome_t found = {.length = centre_length_found};
+        if (reaches_edge(worker, centre, centre_length_found))
+        {
+            found = extend_centre(worker, centre, centre_length_found);
+        }
+        else if (reportable(worker, found.length))
+        {
+            found.start = character_offset(worker, (centre - found.length + 1) / 2);
+            found.end = character_offset(worker, (centre + found.length - 1) / 2) + 1;
+        }
+        if (reportable(worker, found.length) && !report_palindrome(worker, chunk, &found))
+            return false;
+    }
+    return true;
+}
+
+static void *run_search_worker(void *argument)
+{
+    search_worker_t *worker = argument;
+    search_t *search = worker->search;
+    for (;;)
+    {
+        size_t const chunk = atomic_fetch_add(&search->next_chunk, 1);
+        if (chunk >= search->chunk_count)
+            break;
+        if (!search_chunk(worker, chunk))
+        {
+            worker->failed = true;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void free_search_worker(search_worker_t *worker)
+{
+    free(worker->text);
+    free(worker->position);
+    free(worker->odd);
+    free(worker->even);
+    free(worker->longest);
+}
+
+/**
+ * Searches the input for palindromes with the given number of threads.
+ * Fills longest with up to search->top of the longest palindromes and
+ * search->found with every palindrome of at least search->min_length.
+ * The number of threads actually used is stored in search->threads.
+ */
+static bool search_palindromes(search_t *search, int threads, palindrome_t *longest, size_t *longest_count)
+{
+    search->chunk_count = (search->size + search->chunk - 1) / search->chunk;
+    atomic_init(&search->next_chunk, 0);
+    search->found = calloc(search->chunk_count ? search->chunk_count : 1, sizeof(palindrome_list_t));
+    if (!search->found)
+        return false;
+
+    if ((size_t)threads > search->chunk_count)
+        threads = search->chunk_count ? search->chunk_count : 1;
+    search->threads = threads;
+    search_worker_t *workers = calloc(threads, sizeof(search_worker_t));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    bool ok = workers && ids;
+
+    size_t const window = search->chunk + 2 * search->overlap;
+    int started = 0;
+    for (; ok && started < threads; started++)
+    {
+        search_worker_t *worker = &workers[started];
+        worker->search = search;
+        worker->text = malloc(window);
+        worker->position = malloc(window * sizeof(uint32_t));
+        worker->odd = malloc(window * sizeof(int64_t));
+        worker->even = malloc(window * sizeof(int64_t));
+        worker->longest = malloc(search->top * sizeof(palindrome_t));
+        if (!worker->text || !worker->position || !worker->odd || !worker->even || !worker->longest ||
+            pthread_create(&ids[started], NULL, run_search_worker, worker) != 0)
+        {
+            free_search_worker(worker);
+            ok = false;
+            break;
+        }
+    }
+
+    *longest_count = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(ids[i], NULL);
+        ok = ok && !workers[i].failed;
+        for (size_t j = 0; j < workers[i].longest_count; j++)
+        {
+            insert_longest(longest, longest_count, search->top, &workers[i].longest[j]);
+        }
+        free_search_worker(&workers[i]);
+    }
+    free(workers);
+    free(ids);
+    return ok;
+}
+
+static void free_search(search_t *search)
+{
+    for (size_t i = 0; search->found && i < search->chunk_count; i++)
+    {
+        free(search->found[i].items);
+    }
+    free(search->found);
+    search->found = NULL;
+}
+
+/**
+ * Prints where a palindrome is and how it starts
+ */
+static void print_palindrome(unsigned char const *data, palindrome_t const *palindrome)
+{
+    printf("%10zu characters at bytes %zu-%zu: ", palindrome->length, palindrome->start, palindrome->end);
+    size_t const end = palindrome->end - palindrome->start > SEARCH_PREVIEW ? palindrome->start + SEARCH_PREVIEW : palindrome->end;
+    for (size_t i = palindrome->start; i < end; i++)
+    {
+        putchar(data[i] < 32 || data[i] >= 127 ? ' ' : data[i]);
+    }
+    printf(end < palindrome->end ? "...\n" : "\n");
+}
+
+/**
+ * Runs a search over a file and prints the palindromes found and how fast
+ * the search went
+ */
+static int run_search(char const *path, int threads, size_t top, size_t min_length)
+{
+    unsigned char const *data;
+    size_t size;
+    if (!map_file(path, &data, &size))
+    {
+        fprintf(stderr, "Could not read %s\n", path);
+        return 2;
+    }
+    if (data)
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    search_t search = {
+        .data = data,
+        .size = size,
+        .chunk = SEARCH_CHUNK,
+        .overlap = SEARCH_OVERLAP,
+        .top = top,
+        .min_length = min_length,
+    };
+    palindrome_t *longest = malloc(top * sizeof(palindrome_t));
+    size_t longest_count = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool const ok = longest && search_palindromes(&search, threads, longest, &longest_count);
+    double const seconds = seconds_since(&start);
+
+    if (ok)
+    {
+        printf("Longest palindromes:\n");
+        for (size_t i = 0; i < longest_count; i++)
+        {
+            print_palindrome(data, &longest[i]);
+        }
+        if (min_length)
+        {
+            size_t count = 0;
+            for (size_t i = 0; i < search.chunk_count; i++)
+            {
+                count += search.found[i].count;
+            }
+            printf("%zu palindromes of at least %zu characters:\n", count, min_length);
+            for (size_t i = 0; i < search.chunk_count; i++)
+            {
+                for (size_t j = 0; j < search.found[i].count; j++)
+                {
+                    print_palindrome(data, &search.found[i].items[j]);
+                }
+            }
+        }
+        printf("Searched %.1f MB in %.3f s, %.1f MB/s with %d threads\n", size / 1e6, seconds,
+               size / 1e6 / seconds, search.threads);
+    }
+    else
+    {
+        fprintf(stderr, "Out of memory searching %s\n", path);
+    }
+
+    free(longest);
+    free_search(&search);
+    if (data)
+        munmap((void *)data, size);
+    return ok ? 0 : 2;
+}
+
+static void print_usage(char const *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--kernel avx2|sse|bytes] (FILE | --string TEXT)\n"
+            "       %s --search [--top N] [--min-length N] [--threads N] FILE\n"
+            "       %s --bench\n"
+            "Checks whether the input reads the same both ways, skipping whitespace and\n"
+            "ignoring case like palin_finder.py. --search instead lists the longest\n"
+            "palindromes in the file, and every one of at least --min-length characters.\n",
+            program, program, program);
+}
+
+int main(int argc, char **argv)
+{
+    init_normalized();
+#ifdef HAVE_X86_KERNELS
+    init_compact_lut();
+#endif
+
+    kernel_t const *kernel = best_kernel();
+    char const *path = NULL;
+    char const *string = NULL;
+    bool bench = false;
+    bool search = false;
+    size_t top = SEARCH_TOP;
+    size_t min_length = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = true;
+        }
+        else if (strcmp(argv[i], "--search") == 0)
+        {
+            search = true;
+        }
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            top = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--min-length") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            min_length = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--string") == 0 && i + 1 < argc)
+        {
+            string = argv[++i];
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+        {
+            char const *name = argv[++i];
+            kernel = NULL;
+            for (size_t k = 0; k < KERNEL_COUNT; k++)
+            {
+                if (strcmp(KERNELS[k].name, name) == 0 && KERNELS[k].supported())
+                    kernel = &KERNELS[k];
+            }
+            if (!kernel)
+            {
+                fprintf(stderr, "Kernel %s is not available\n", name);
+                return 2;
+            }
+        }
+        else if (argv[i][0] != '-' && !path)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (bench)
+        return run_benchmark();
+    if (search)
+    {
+        if (!path || string)
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_search(path, threads > 0 ? threads : 1, top, min_length);
+    }
+    if (!path == !string)
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    bool palindrome;
+    if (string)
+    {
+        palindrome = is_palindrome(kernel, (unsigned char const *)string, strlen(string), false);
+    }
+    else
+    {
+        unsigned char const *data;
+        size_t length;
+        if (!map_file(path, &data, &length))
+        {
+            fprintf(stderr, "Could not read %s\n", path);
+            return 2;
+        }
+        palindrome = is_palindrome(kernel, data, length, true);
+        if (data)
+            munmap((void *)data, length);
+    }
+
+    // Same messages as the assembly version
+    printf(palindrome ? "Palindrome detected\n" : "Not a palindrome\n");
+    return palindrome ? 0 : 1;
+}
@@ -5,11 +5,77 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 // Macro for computing how many bits are required to store unsigned
 // values up the the given value
 #define BIT_WIDTH(value) log2(value)
 
+// Maximum amount of records decoded from the trace before they are
+// handed to the simulator
+#define BATCH_SIZE (1 << 16)
+
+// Longest trace line read at once, and the room kept for the lines that
+// are read ahead of decoding them
+#define LINE_LENGTH 1000
+#define LINE_BUFFER (BATCH_SIZE * 32 + LINE_LENGTH)
+
+// Largest access size accepted from the trace, in bytes
+#define MAX_ACCESS_SIZE 4096
+
+// Decoded batches that may be queued for the shard threads at a time when
+// simulating in parallel
+#define SHARD_QUEUE 4
+
+// Upper bound of outstanding misses supported by the timing model
+#define MAX_MSHRS 64
+
+// Profiling counters are compiled out unless CACHE_SIM_PROFILE is defined,
+// e. g. by building with -DCACHE_SIM_PROFILE. Ticks are read using the time
+// stamp counter where it is available, and converted to nanoseconds using
+// the wall clock time of the whole run.
+#ifdef CACHE_SIM_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_TICKS() __rdtsc()
+#else
+#define PROFILE_TICKS() profile_clock()
+#endif
+#define PROFILE_START(name) uint64_t name = PROFILE_TICKS()
+#define PROFILE_STOP(name, counter) (counter) += PROFILE_TICKS() - name
+#define PROFILE_PROBES(count) (profile.probed_accesses++, profile.probes += (count))
+#else
+#define PROFILE_START(name)
+#define PROFILE_STOP(name, counter)
+#define PROFILE_PROBES(count)
+#endif
+
+// Upper bound of traces that can share a cache. Limited by the size of
+// the owner stored in every cache line.
+#define MAX_PROGRAMS 16
+
+// Amount of accesses between every sample of the per program occupancy
+#define OCCUPANCY_INTERVAL 4096
+
+// The OPT oracle processes the spilled trace in chunks of this many
+// records, releasing every chunk from memory once it is done
+#define OPT_CHUNK (1 << 20)
+// Next use of a block that is never accessed again
+#define OPT_NEVER UINT64_MAX
+// Marks an empty slot in a block map
+#define MAP_EMPTY UINT32_MAX
+
+// Page size used by the working set analysis
+#define PAGE_SIZE 4096
+
+// HyperLogLog sketches use 2^HLL_PRECISION registers, giving a standard
+// error of about 1.04 / sqrt(2^HLL_PRECISION), i. e. 1.6%
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
 typedef enum
 {
     dm,
@@ -25,13 +91,68 @@ typedef enum
     instruction,
     data
 } access_t;
+typedef enum
+{
+    rr,
+    weighted,
+    timeslice
+} schedule_t;
 
 typedef struct
 {
     uint32_t address;
     access_t accesstype;
+    uint32_t size;   // Amount of bytes accessed, starting at the address
+    uint8_t program; // Which trace the access belongs to when sharing a cache
 } mem_access_t;
 
+/**
+ * A run of back-to-back accesses to the same block from the same stream.
+ * Only the first access has to go through the simulator, every repeat is
+ * guaranteed to hit since nothing can evict the block in between.
+ */
+typedef struct
+{
+    mem_access_t access;
+    uint32_t repeats;
+} mem_run_t;
+
+/**
+ * A batch of decoded trace records, along with the state of the
+ * coalescing front stage
+ */
+typedef struct
+{
+    mem_run_t *runs;
+    uint32_t count;
+    bool coalesce;     // Whether consecutive same block accesses are merged
+    bool split;        // Whether the streams may be coalesced independently
+    uint32_t bits_offset;
+    uint64_t accesses; // Total amount of accesses read from the trace
+    uint64_t records;  // Total amount of records handed to the simulator
+} trace_batch_t;
+
+/**
+ * Lines read from a trace file ahead of decoding them. A batch worth of
+ * lines is read in one pass and decoded in another, so that the profiling
+ * counters are only sampled once per pass. Every thread reading a trace
+ * has its own lines, and with them its own counters.
+ */
+typedef struct
+{
+    char *text;
+    uint32_t used;     // Bytes of text holding lines
+    uint32_t *starts;  // Offset of every line in text
+    uint32_t count;
+    uint32_t next;     // First line not decoded yet
+    uint64_t number;   // Lines decoded so far, for error messages
+    bool done;         // Whether the end of the trace was reached
+#ifdef CACHE_SIM_PROFILE
+    uint64_t read_ticks;
+    uint64_t parse_ticks;
+#endif
+} trace_lines_t;
+
 typedef struct
 {
     uint64_t accesses;
@@ -39,11 +160,14 @@ typedef struct
     // You can declare additional statistics if
     // you like, however you are now allowed to
     // remove the accesses or hits
+    uint64_t splits; // Accesses spanning several blocks. Every block is
+                     // counted as a separate access.
 } cache_stat_t;
 
 typedef struct
 {
     bool valid;
+    uint8_t owner; // Program that brought the line in. Fits in the padding.
     uint32_t tag;
     uint64_t inserted_at; // To implement FIFO for FA
 } cache_line_t;
@@ -60,6 +184,16 @@ typedef struct
     uint32_t bits_offset;
     uint32_t bits_index;
     uint32_t bits_tag;
+    // Bytes used per line by the compact encoding, or 0 if the lines are
+    // stored as regular cache_line_t structs. A compact line is only the
+    // tag bits, shifted up by one to make room for the valid bit.
+    uint32_t line_width;
+    // Next line to replace in a compact fully associative cache. Compact
+    // lines have no timestamp, so the FIFO order is kept here instead.
+    uint32_t fifo_next;
+    // Lines owned by every program. Only kept up to date when several
+    // programs share the cache, and NULL otherwise.
+    uint64_t *owned;
     cache_stat_t statistics;
     cache_line_t lines[];
 } cache_t;
@@ -74,6 +208,212 @@ typedef struct
     cache_t *data;
 } cache_total_t;
 
+/**
+ * Reads a trace in a separate thread, so that decoding the next batch
+ * overlaps with simulating the current one. Batches are double buffered,
+ * the reader fills one while the simulator consumes the other.
+ */
+typedef struct
+{
+    FILE *file;
+    uint8_t program;
+    trace_lines_t lines;
+    trace_batch_t batches[2];
+    bool filled[2];    // Set by the reader, cleared by the simulator
+    uint32_t current;  // Batch currently consumed by the simulator
+    uint32_t position; // Next record of the current batch
+    bool acquired;     // Whether the simulator holds the current batch
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} trace_reader_t;
+
+/**
+ * Several traces interleaved into one shared cache, along with the
+ * scheduler deciding who gets to run and the per program results
+ */
+typedef struct
+{
+    schedule_t schedule;
+    uint32_t count;
+    const char *files[MAX_PROGRAMS];
+    uint32_t weights[MAX_PROGRAMS]; // Accesses per turn when weighted
+    uint64_t quantum;               // Accesses per turn when timesliced
+    uint64_t context_switches;
+
+    cache_stat_t statistics[MAX_PROGRAMS];
+    uint64_t occupancy[MAX_PROGRAMS]; // Sum of the sampled lines owned
+    uint64_t samples;
+    uint64_t final_occupancy[MAX_PROGRAMS];
+} programs_t;
+
+/**
+ * Miss status holding register. Tracks a single outstanding miss.
+ */
+typedef struct
+{
+    uint32_t block;
+    uint64_t ready_at; // Cycle at which the block arrives from memory
+} mshr_t;
+
+/**
+ * State of the timing model layered on top of the cache simulation. The
+ * processor issues one access per cycle, all latencies are in cycles.
+ */
+typedef struct
+{
+    uint32_t hit_latency;
+    uint32_t memory_latency;
+    uint32_t memory_bandwidth; // Bytes transferred per cycle
+    uint32_t transfer_cycles;  // Cycles needed to transfer a single block
+    uint32_t mshr_count;
+
+    mshr_t mshrs[MAX_MSHRS]; // Queue of outstanding misses, oldest at head
+    uint32_t head;
+    uint32_t outstanding;
+
+    uint64_t cycle;        // Cycle at which the next access is issued
+    uint64_t bus_free_at;  // Cycle at which the memory bus is available
+    uint64_t accounted_at; // Cycle up to which the occupancy is accounted
+
+    uint64_t accesses;
+    uint64_t total_latency;
+    uint64_t stall_cycles;
+    uint64_t merges;
+    uint64_t occupancy[MAX_MSHRS + 1]; // Cycles spent with N outstanding misses
+} timing_model_t;
+
+#ifdef CACHE_SIM_PROFILE
+/**
+ * Counters collected when profiling is compiled in
+ */
+typedef struct
+{
+    uint64_t read_ticks;     // Reading lines from the trace file
+    uint64_t parse_ticks;    // Decoding and coalescing the lines, both
+                             // merged from the trace_lines_t of every thread
+    uint64_t simulate_ticks; // Simulating the decoded batches. With --threads
+                             // only handing them to the shards and waiting
+    uint64_t shard_ticks;    // Busy time of every shard thread, summed
+    uint64_t probes;         // Lines scanned by fully associative lookups
+    uint64_t probed_accesses;
+} profile_t;
+
+profile_t profile;
+
+/**
+ * Monotonic clock in nanoseconds, used as tick source where there is no
+ * time stamp counter
+ */
+uint64_t profile_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#endif
+
+/**
+ * HyperLogLog sketch for estimating the amount of distinct values
+ */
+typedef struct
+{
+    uint8_t registers[HLL_REGISTERS];
+} hll_t;
+
+/**
+ * State of the working set analysis. Keeps one sketch per stream and
+ * granularity for the current window, and one for the whole trace.
+ */
+typedef struct
+{
+    uint64_t window_size;
+    uint64_t window;    // Index of the current window
+    uint64_t in_window; // Accesses seen in the current window
+    uint32_t bits_offset;
+    hll_t window_blocks[2];
+    hll_t window_pages[2];
+    hll_t total_blocks[2];
+    hll_t total_pages[2];
+} working_set_t;
+
+/**
+ * Open addressing hash map from block keys to 64-bit values
+ */
+typedef struct
+{
+    uint32_t *keys;
+    uint64_t *values;
+    uint64_t mask;
+    uint64_t count;
+} block_map_t;
+
+/**
+ * A fully associative cache replacing the line used furthest in the
+ * future, i. e. Belady's MIN. The lines are kept in a max heap on their
+ * next use, and a map finds the line holding a given block.
+ */
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t *keys;     // Block held by every line
+    uint64_t *next_use; // Index of the next access to the block of every line
+    uint32_t *heap;     // Lines ordered on their next use, furthest first
+    uint32_t *position; // Position of every line in the heap
+    block_map_t lines;
+    cache_stat_t statistics;
+} opt_cache_t;
+
+/**
+ * The decoded trace spilled to a temporary file, from which the OPT
+ * oracle is computed once the whole trace has been read. Only one key
+ * per run is stored, as the repeats are guaranteed hits also under OPT.
+ */
+typedef struct
+{
+    FILE *keys;
+    uint64_t count;
+    bool split;
+    uint32_t bits_offset;
+    uint64_t repeats[2]; // Repeats of every cache, credited as hits
+} opt_trace_t;
+
+/**
+ * Hands the decoded batches from the main thread to the shard threads.
+ * Every shard has its own queue of SHARD_QUEUE slots, and batch n goes
+ * into slot n % SHARD_QUEUE of every queue.
+ */
+typedef struct
+{
+    uint64_t published; // Batches handed to the shards
+    bool finished;      // Set once the whole trace has been handed out
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} shard_queue_t;
+
+/**
+ * A slice of the cache owned by a single thread when simulating in
+ * parallel. Since sets in a directly mapped cache evolve independently,
+ * every shard can be simulated on its own and the statistics merged.
+ */
+typedef struct
+{
+    cache_total_t *cache;
+    shard_queue_t *queue;
+    mem_run_t *runs[SHARD_QUEUE]; // The records of this shard, in trace order
+    uint32_t counts[SHARD_QUEUE];
+    uint32_t capacity[SHARD_QUEUE];
+    uint64_t done;             // Batches simulated so far
+    cache_stat_t statistics;   // The shares of the total statistics,
+    cache_stat_t instructions; // the instruction cache statistics and
+    cache_stat_t data;         // the data cache statistics
+    pthread_t thread;
+#ifdef CACHE_SIM_PROFILE
+    uint64_t busy_ticks; // Spent simulating, merged once the thread is done
+#endif
+} shard_t;
+
 /**
  * Gets the tag for the address of the given memory access in the
  * given cache
@@ -88,9 +428,20 @@ uint32_t get_tag(cache_t cache, mem_access_t access)
 }
 
 /**
- * Allocates a new cache and initializes the values
+ * Gets the compact line representation for the given memory access. Only
+ * the tag bits are kept, and the lowest bit is set to mark the line as
+ * valid, so that a line of all zeroes is empty.
  */
-cache_t *make_cache(uint32_t size, uint32_t block_size, cache_map_t map)
+uint32_t get_compact_line(cache_t cache, mem_access_t access)
+{
+    return ((access.address >> (cache.bits_offset + cache.bits_index)) << 1) | 1;
+}
+
+/**
+ * Allocates a new cache and initializes the values. If compact is set,
+ * the lines are stored using the narrowest encoding that fits the tag.
+ */
+cache_t *make_cache(uint32_t size, uint32_t block_size, cache_map_t map, bool compact)
 {
     uint32_t blocks = size / block_size;
     // Making sure we don't end up in a situation where we have 0 blocks,
@@ -101,21 +452,36 @@ cache_t *make_cache(uint32_t size, uint32_t block_size, cache_map_t map)
         exit(1);
     }
 
+    uint32_t bits_offset = BIT_WIDTH(block_size);
+    uint32_t bits_index = (map == dm) ? BIT_WIDTH(blocks) : 0;
+    uint32_t bits_tag = 32 - bits_offset - bits_index;
+
+    // The compact encoding needs one extra bit for the valid flag
+    uint32_t line_width = 0;
+    if (compact)
+    {
+        line_width = (bits_tag + 1 <= 16) ? sizeof(uint16_t) : sizeof(uint32_t);
+    }
+
     // Compute the amount of memory we need to allocate, allocate it
     // and then make sure that the memory doesn't contain any old values
-    size_t mem_size = sizeof(cache_t) + (sizeof(cache_line_t) * blocks);
+    size_t mem_size = sizeof(cache_t) + ((line_width ? line_width : sizeof(cache_line_t)) * (size_t)blocks);
     cache_t *cache = malloc(mem_size);
     memset(cache, 0, mem_size);
 
     cache->blocks = blocks;
-    cache->bits_offset = BIT_WIDTH(block_size);
-    cache->bits_index = (map == dm) ? BIT_WIDTH(cache->blocks) : 0;
-    cache->bits_tag = 32 - cache->bits_offset - cache->bits_index;
+    cache->bits_offset = bits_offset;
+    cache->bits_index = bits_index;
+    cache->bits_tag = bits_tag;
+    cache->line_width = line_width;
+    // Matches the order in which the regular fully associative cache
+    // fills its lines, starting from the last one
+    cache->fifo_next = blocks - 1;
 
     return cache;
 }
 
-cache_total_t *make_total_cache(uint32_t size, uint32_t block_size, cache_map_t map, cache_org_t org)
+cache_total_t *make_total_cache(uint32_t size, uint32_t block_size, cache_map_t map, cache_org_t org, bool compact)
 {
     // We don't need to memset this because we initialize all values later
     cache_total_t *cache = malloc(sizeof(cache_total_t));
@@ -127,13 +493,13 @@ cache_total_t *make_total_cache(uint32_t size, uint32_t block_size, cache_map_t
     {
         size >>= 1; // Divide by 2 since the caches should be of equal size
 
-        cache->data = make_cache(size, block_size, map);
-        cache->instructions = make_cache(size, block_size, map);
+        cache->data = make_cache(size, block_size, map, compact);
+        cache->instructions = make_cache(size, block_size, map, compact);
     }
     else
     {
         // Unified cache just means we set the pointers to the same location
-        cache_t *unified = make_cache(size, block_size, map);
+        cache_t *unified = make_cache(size, block_size, map, compact);
         cache->data = unified;
         cache->instructions = unified;
     }
@@ -149,15 +515,86 @@ cache_total_t *make_total_cache(uint32_t size, uint32_t block_size, cache_map_t
 }
 
 /**
- * Simulate memory access with fully associative cache
+ * Accounts a line being replaced by a line of the given program, if the
+ * cache keeps track of the lines owned by every program
+ */
+void track_owner(cache_t *cache, cache_line_t replaced, uint8_t owner)
+{
+    if (cache->owned)
+    {
+        if (replaced.valid)
+        {
+            cache->owned[replaced.owner]--;
+        }
+        cache->owned[owner]++;
+    }
+}
+
+/**
+ * Looks up the given access in a compact fully associative cache, and
+ * replaces the oldest line if it is not present. Returns true on a hit.
+ */
+bool probe_fa_compact(cache_t *cache, mem_access_t access)
+{
+    uint32_t line = get_compact_line(*cache, access);
+
+    if (cache->line_width == sizeof(uint16_t))
+    {
+        uint16_t *lines = (uint16_t *)cache->lines;
+        for (uint32_t i = 0; i < cache->blocks; i++)
+        {
+            if (lines[i] == line)
+            {
+                PROFILE_PROBES(i + 1);
+                return true;
+            }
+        }
+
+        lines[cache->fifo_next] = line;
+    }
+    else
+    {
+        uint32_t *lines = (uint32_t *)cache->lines;
+        for (uint32_t i = 0; i < cache->blocks; i++)
+        {
+            if (lines[i] == line)
+            {
+                PROFILE_PROBES(i + 1);
+                return true;
+            }
+        }
+
+        lines[cache->fifo_next] = line;
+    }
+
+    PROFILE_PROBES(cache->blocks);
+    cache->fifo_next = (cache->fifo_next == 0) ? cache->blocks - 1 : cache->fifo_next - 1;
+    return false;
+}
+
+/**
+ * Simulate an access to a single block with fully associative cache.
+ * Returns true on a hit.
  */
-void access_mem_fa(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
+bool access_block_fa(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
 {
     uint32_t tag = get_tag(*cache, access);
 
     statistics->accesses++;
     cache->statistics.accesses++;
 
+    if (cache->line_width)
+    {
+        if (!probe_fa_compact(cache, access))
+        {
+            return false;
+        }
+
+        cache->statistics.hits++;
+        statistics->hits++;
+        return true;
+    }
+
     uint32_t index = 0;
 
     for (uint32_t i = 0; i < cache->blocks; i++)
@@ -174,25 +611,30 @@ void access_mem_fa(cache_t *cache, cache_stat_t *statistics, mem_access_t access
             index = i;
         }
 
-        if (curr.tag != tag)
+        if (curr.tag != tag || curr.owner != access.program)
         {
             continue;
         }
 
+        PROFILE_PROBES(i + 1);
         cache->statistics.hits++;
         statistics->hits++;
-        return;
+        return true;
     }
 
+    PROFILE_PROBES(cache->blocks);
     cache_line_t line = cache->lines[index];
+    track_owner(cache, line, access.program);
 
     // Only keep track of when inserted since we are implementing a FIFO queue.
     // Change this to update with every access to implement LRU cache.
     line.inserted_at = statistics->accesses;
     line.valid = true;
+    line.owner = access.program;
     line.tag = tag;
 
     cache->lines[index] = line;
+    return false;
 }
 
 /**
@@ -207,9 +649,12 @@ uint32_t get_index(cache_t cache, mem_access_t access)
 }
 
 /**
- * Simulate memory access with directly mapped cache
+ * Looks up the given access in a directly mapped cache, and inserts the
+ * block if it is not present. Returns true on a hit. This does not touch
+ * any statistics, so threads working on disjoint sets may call it
+ * concurrently on the same cache.
  */
-void access_mem_dm(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
+bool probe_dm(cache_t *cache, mem_access_t access, uint64_t now)
 {
     uint32_t tag = get_tag(*cache, access);
     uint32_t index = get_index(*cache, access);
@@ -221,170 +666,1764 @@ void access_mem_dm(cache_t *cache, cache_stat_t *statistics, mem_access_t access
     {
         printf("Illegal access! Index: %d, max: %d\n", index, cache->blocks);
         exit(1);
-        return;
     }
 
-    statistics->accesses++;
-    cache->statistics.accesses++;
+    if (cache->line_width == sizeof(uint16_t))
+    {
+        uint16_t *lines = (uint16_t *)cache->lines;
+        uint16_t line = get_compact_line(*cache, access);
+        if (lines[index] == line)
+            return true;
+
+        lines[index] = line;
+        return false;
+    }
+
+    if (cache->line_width == sizeof(uint32_t))
+    {
+        uint32_t *lines = (uint32_t *)cache->lines;
+        uint32_t line = get_compact_line(*cache, access);
+        if (lines[index] == line)
+            return true;
+
+        lines[index] = line;
+        return false;
+    }
 
     cache_line_t line = cache->lines[index];
 
-    if (line.valid && line.tag == tag)
+    if (line.valid && line.tag == tag && line.owner == access.program)
     {
-        statistics->hits++;
-        cache->statistics.hits++;
-        return;
+        return true;
     }
 
     // Line is not present in cache. Insert it.
+    track_owner(cache, line, access.program);
     line.valid = true;
+    line.owner = access.program;
     line.tag = tag;
-    line.inserted_at = statistics->accesses;
+    line.inserted_at = now;
 
     cache->lines[index] = line;
+    return false;
 }
 
-/* Reads a memory access from the trace file and returns
- * 1) access type (instruction or data access
- * 2) memory address
+/**
+ * Simulate an access to a single block with directly mapped cache.
+ * Returns true on a hit.
  */
-mem_access_t read_transaction(FILE *ptr_file)
+bool access_block_dm(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
 {
-    char buf[1000];
-    char *token;
-    char *string = buf;
-    mem_access_t access;
+    statistics->accesses++;
+    cache->statistics.accesses++;
 
-    if (fgets(buf, 1000, ptr_file) != NULL)
+    if (!probe_dm(cache, access, statistics->accesses))
     {
-
-        /* Get the access type */
-        token = strsep(&string, " \n");
-        if (strcmp(token, "I") == 0)
-        {
-            access.accesstype = instruction;
-        }
-        else if (strcmp(token, "D") == 0)
-        {
-            access.accesstype = data;
-        }
-        else
-        {
-            printf("Unkown access type\n");
-            exit(0);
-        }
-
-        /* Get the access type */
-        token = strsep(&string, " \n");
-        access.address = (uint32_t)strtol(token, NULL, 16);
-
-        return access;
+        return false;
     }
 
-    /* If there are no more entries in the file,  
-     * return an address 0 that will terminate the infinite loop in main
-     */
-    access.address = 0;
-    return access;
+    statistics->hits++;
+    cache->statistics.hits++;
+    return true;
 }
 
-void main(int argc, char **argv)
+/**
+ * Gets the amount of blocks the given memory access touches in the
+ * given cache
+ */
+uint32_t get_block_span(cache_t cache, mem_access_t access)
 {
-    // DECLARE CACHES AND COUNTERS FOR THE STATS HERE
+    uint32_t offset = access.address & ((1 << cache.bits_offset) - 1);
+    return ((offset + access.size - 1) >> cache.bits_offset) + 1;
+}
 
-    uint32_t cache_size;
-    uint32_t block_size = 64;
-    cache_map_t cache_mapping;
-    cache_org_t cache_org;
+/**
+ * Gets the part of the given memory access that falls within the n-th
+ * block it touches
+ */
+mem_access_t get_block_part(cache_t cache, mem_access_t access, uint32_t n)
+{
+    uint32_t block_size = 1 << cache.bits_offset;
+    uint32_t start = (n == 0) ? access.address : ((access.address >> cache.bits_offset) + n) << cache.bits_offset;
+    uint32_t remaining = access.address + access.size - start;
+    uint32_t room = block_size - (start & (block_size - 1));
 
-    // USE THIS FOR YOUR CACHE STATISTICS
-    cache_stat_t cache_statistics;
+    mem_access_t part = access;
+    part.address = start;
+    part.size = (remaining < room) ? remaining : room;
+    return part;
+}
 
-    // Reset statistics:
-    memset(&cache_statistics, 0, sizeof(cache_stat_t));
+/**
+ * Splits a memory access spanning several blocks, and simulates an access
+ * to every one of them. Returns true if every block was a hit.
+ */
+bool access_mem_split(cache_t *cache, cache_stat_t *statistics, mem_access_t access,
+                      bool (*access_block)(cache_t *, cache_stat_t *, mem_access_t))
+{
+    uint32_t span = get_block_span(*cache, access);
+    bool hit = true;
 
-    /* Read command-line parameters and initialize:
-     * cache_size, cache_mapping and cache_org variables
-     */
+    statistics->splits++;
+    cache->statistics.splits++;
 
-    if (argc != 4)
-    { /* argc should be 2 for correct execution */
-        printf("Usage: ./cache_sim [cache size: 128-4096] [cache mapping: dm|fa] [cache organization: uc|sc]\n");
-        exit(0);
-    }
-    else
+    for (uint32_t i = 0; i < span; i++)
     {
-        /* argv[0] is program name, parameters start with argv[1] */
-
-        /* Set cache size */
-        cache_size = atoi(argv[1]);
+        hit &= access_block(cache, statistics, get_block_part(*cache, access, i));
+    }
 
-        /* Set Cache Mapping */
-        if (strcmp(argv[2], "dm") == 0)
-        {
-            cache_mapping = dm;
-        }
-        else if (strcmp(argv[2], "fa") == 0)
-        {
-            cache_mapping = fa;
-        }
-        else
-        {
-            printf("Unknown cache mapping\n");
-            exit(0);
-        }
+    return hit;
+}
 
-        /* Set Cache Organization */
-        if (strcmp(argv[3], "uc") == 0)
-        {
-            cache_org = uc;
-        }
-        else if (strcmp(argv[3], "sc") == 0)
-        {
-            cache_org = sc;
-        }
-        else
-        {
-            printf("Unknown cache organization\n");
-            exit(0);
-        }
+/**
+ * Simulate memory access with fully associative cache. Returns true if
+ * every block touched by the access was a hit.
+ */
+bool access_mem_fa(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
+{
+    // Nearly all accesses stay within a single block, so check for that first
+    if (__builtin_expect(get_block_span(*cache, access) == 1, 1))
+    {
+        return access_block_fa(cache, statistics, access);
     }
 
-    // Make caches
-    cache_total_t *cache = make_total_cache(cache_size, block_size, cache_mapping, cache_org);
+    return access_mem_split(cache, statistics, access, access_block_fa);
+}
 
-    /* Open the file mem_trace.txt to read memory accesses */
-    FILE *ptr_file;
-    ptr_file = fopen("mem_trace.txt", "r");
-    if (!ptr_file)
+/**
+ * Simulate memory access with directly mapped cache. Returns true if
+ * every block touched by the access was a hit.
+ */
+bool access_mem_dm(cache_t *cache, cache_stat_t *statistics, mem_access_t access)
+{
+    if (__builtin_expect(get_block_span(*cache, access) == 1, 1))
     {
-        printf("Unable to open the trace file\n");
-        exit(1);
+        return access_block_dm(cache, statistics, access);
     }
 
-    /* Loop until whole trace file has been read */
-    mem_access_t access;
-    while (1)
+    return access_mem_split(cache, statistics, access, access_block_dm);
+}
+
+/**
+ * Simulates a run of accesses. The first access goes through the regular
+ * simulator, while the repeats are credited as hits in bulk. Returns
+ * whether the first access was a hit.
+ */
+bool access_mem_run(cache_t *cache, cache_stat_t *statistics, mem_run_t run, cache_map_t map)
+{
+    bool hit = (map == dm) ? access_mem_dm(cache, statistics, run.access)
+                           : access_mem_fa(cache, statistics, run.access);
+
+    statistics->accesses += run.repeats;
+    statistics->hits += run.repeats;
+    cache->statistics.accesses += run.repeats;
+    cache->statistics.hits += run.repeats;
+
+    return hit;
+}
+
+/**
+ * Brings the timing model up to the given cycle, retiring every miss that
+ * has returned from memory by then and accounting the MSHR occupancy of
+ * the elapsed cycles.
+ */
+void timing_advance(timing_model_t *model, uint64_t until)
+{
+    // Transfers over the memory bus are serialized, so misses always return
+    // in the order they were issued. This lets us keep the MSHRs as a queue.
+    while (model->outstanding > 0 && model->mshrs[model->head].ready_at <= until)
+    {
+        uint64_t ready_at = model->mshrs[model->head].ready_at;
+        if (ready_at > model->accounted_at)
+        {
+            model->occupancy[model->outstanding] += ready_at - model->accounted_at;
+            model->accounted_at = ready_at;
+        }
+
+        model->head = (model->head + 1) % model->mshr_count;
+        model->outstanding--;
+    }
+
+    if (until > model->accounted_at)
+    {
+        model->occupancy[model->outstanding] += until - model->accounted_at;
+        model->accounted_at = until;
+    }
+}
+
+/**
+ * Finds the MSHR tracking an outstanding miss to the given block, or
+ * NULL if there is none
+ */
+mshr_t *timing_find_mshr(timing_model_t *model, uint32_t block)
+{
+    for (uint32_t i = 0; i < model->outstanding; i++)
+    {
+        mshr_t *mshr = &model->mshrs[(model->head + i) % model->mshr_count];
+        if (mshr->block == block)
+        {
+            return mshr;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Issues a single access in the timing model. Every access takes the hit
+ * latency, plus the time until the block arrives if it is still on its way
+ * from memory. Misses to a block that is already outstanding are merged
+ * into the existing MSHR. Instruction fetches block until their block has
+ * arrived, while data misses only stall the processor when every MSHR is
+ * in use.
+ */
+void timing_access(timing_model_t *model, access_t type, uint32_t block, bool hit)
+{
+    timing_advance(model, model->cycle);
+
+    uint64_t ready_at = 0;
+    mshr_t *pending = (model->outstanding > 0) ? timing_find_mshr(model, block) : NULL;
+
+    if (pending)
+    {
+        model->merges++;
+        ready_at = pending->ready_at;
+    }
+    else if (!hit)
+    {
+        // Wait for the oldest miss to return if we are out of MSHRs
+        if (model->outstanding == model->mshr_count)
+        {
+            uint64_t free_at = model->mshrs[model->head].ready_at;
+            model->stall_cycles += free_at - model->cycle;
+            model->cycle = free_at;
+            timing_advance(model, model->cycle);
+        }
+
+        uint64_t start = model->cycle + model->memory_latency;
+        if (start < model->bus_free_at)
+        {
+            start = model->bus_free_at;
+        }
+
+        ready_at = start + model->transfer_cycles;
+        model->bus_free_at = ready_at;
+
+        mshr_t *mshr = &model->mshrs[(model->head + model->outstanding) % model->mshr_count];
+        mshr->block = block;
+        mshr->ready_at = ready_at;
+        model->outstanding++;
+    }
+
+    uint64_t wait = (ready_at > model->cycle) ? ready_at - model->cycle : 0;
+    model->accesses++;
+    model->total_latency += model->hit_latency + wait;
+
+    if (type == instruction)
+    {
+        model->stall_cycles += wait;
+        model->cycle += wait;
+    }
+
+    model->cycle++;
+}
+
+/**
+ * Issues the repeats of a run in the timing model. They all hit, so only
+ * the ones issued while the block is still outstanding need to be looked
+ * at individually. The rest are accounted in bulk.
+ */
+void timing_repeat(timing_model_t *model, access_t type, uint32_t block, uint32_t repeats)
+{
+    while (repeats > 0 && model->outstanding > 0)
+    {
+        timing_advance(model, model->cycle);
+        if (!timing_find_mshr(model, block))
+        {
+            break;
+        }
+
+        timing_access(model, type, block, true);
+        repeats--;
+    }
+
+    model->accesses += repeats;
+    model->total_latency += (uint64_t)repeats * model->hit_latency;
+    model->cycle += repeats;
+}
+
+/**
+ * Hashes a block or page number for use in a HyperLogLog sketch. This is
+ * the finalizer of SplitMix64, which spreads every input bit over the
+ * whole output.
+ */
+uint64_t hll_hash(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+/**
+ * Adds a value to the given sketch
+ */
+void hll_add(hll_t *sketch, uint64_t value)
+{
+    uint64_t hash = hll_hash(value);
+
+    // The top bits pick the register, the rest are used to find the rank.
+    // The rank is the position of the first set bit, and setting the bit
+    // just after the usable ones bounds it.
+    uint32_t index = hash >> (64 - HLL_PRECISION);
+    uint64_t rest = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+
+    if (rank > sketch->registers[index])
+    {
+        sketch->registers[index] = rank;
+    }
+}
+
+/**
+ * Merges the source sketch into the destination sketch
+ */
+void hll_merge(hll_t *destination, hll_t *source)
+{
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++)
+    {
+        if (source->registers[i] > destination->registers[i])
+        {
+            destination->registers[i] = source->registers[i];
+        }
+    }
+}
+
+/**
+ * Estimates the amount of distinct values added to the given sketch
+ */
+double hll_estimate(hll_t *sketch)
+{
+    double sum = 0;
+    uint32_t zeroes = 0;
+
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++)
+    {
+        sum += ldexp(1.0, -sketch->registers[i]);
+        zeroes += sketch->registers[i] == 0;
+    }
+
+    double alpha = 0.7213 / (1 + 1.079 / HLL_REGISTERS);
+    double estimate = alpha * HLL_REGISTERS * HLL_REGISTERS / sum;
+
+    // The raw estimate is heavily biased for small cardinalities, where
+    // linear counting on the empty registers does much better
+    if (estimate <= 2.5 * HLL_REGISTERS && zeroes > 0)
+    {
+        estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeroes);
+    }
+
+    return estimate;
+}
+
+/**
+ * Prints the estimates of the current window and the cumulative estimates,
+ * and then starts a new window
+ */
+void working_set_close_window(working_set_t *working_set)
+{
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        hll_merge(&working_set->total_blocks[i], &working_set->window_blocks[i]);
+        hll_merge(&working_set->total_pages[i], &working_set->window_pages[i]);
+    }
+
+    printf("%8ld %10.0f %8.0f %10.0f %8.0f | %10.0f %8.0f %10.0f %8.0f\n", working_set->window,
+           hll_estimate(&working_set->window_blocks[instruction]), hll_estimate(&working_set->window_pages[instruction]),
+           hll_estimate(&working_set->window_blocks[data]), hll_estimate(&working_set->window_pages[data]),
+           hll_estimate(&working_set->total_blocks[instruction]), hll_estimate(&working_set->total_pages[instruction]),
+           hll_estimate(&working_set->total_blocks[data]), hll_estimate(&working_set->total_pages[data]));
+
+    memset(working_set->window_blocks, 0, sizeof(working_set->window_blocks));
+    memset(working_set->window_pages, 0, sizeof(working_set->window_pages));
+    working_set->window++;
+    working_set->in_window = 0;
+}
+
+/**
+ * Adds the given amount of accesses to the same block to the working set.
+ * A run may span several windows, in which case the block counts towards
+ * every one of them.
+ */
+void working_set_add(working_set_t *working_set, mem_access_t access, uint64_t count)
+{
+    uint64_t block = access.address >> working_set->bits_offset;
+    uint64_t page = access.address / PAGE_SIZE;
+
+    while (count > 0)
+    {
+        hll_add(&working_set->window_blocks[access.accesstype], block);
+        hll_add(&working_set->window_pages[access.accesstype], page);
+
+        uint64_t taken = working_set->window_size - working_set->in_window;
+        if (taken > count)
+        {
+            taken = count;
+        }
+
+        working_set->in_window += taken;
+        count -= taken;
+
+        if (working_set->in_window == working_set->window_size)
+        {
+            working_set_close_window(working_set);
+        }
+    }
+}
+
+/**
+ * Initializes a block map with room for at least the given amount of keys
+ */
+void map_init(block_map_t *map, uint64_t capacity)
+{
+    uint64_t size = 16;
+    while (size < capacity * 2)
+    {
+        size <<= 1;
+    }
+
+    map->keys = malloc(sizeof(uint32_t) * size);
+    map->values = malloc(sizeof(uint64_t) * size);
+    map->mask = size - 1;
+    map->count = 0;
+    memset(map->keys, 0xFF, sizeof(uint32_t) * size);
+}
+
+void map_free(block_map_t *map)
+{
+    free(map->keys);
+    free(map->values);
+}
+
+/**
+ * Gets the slot holding the given key, or the empty slot where it belongs
+ */
+uint64_t map_slot(block_map_t *map, uint32_t key)
+{
+    uint64_t slot = hll_hash(key) & map->mask;
+    while (map->keys[slot] != MAP_EMPTY && map->keys[slot] != key)
+    {
+        slot = (slot + 1) & map->mask;
+    }
+    return slot;
+}
+
+/**
+ * Gets the value of the given key, or NULL if it is not present
+ */
+uint64_t *map_get(block_map_t *map, uint32_t key)
+{
+    uint64_t slot = map_slot(map, key);
+    return (map->keys[slot] == key) ? &map->values[slot] : NULL;
+}
+
+/**
+ * Sets the value of the given key, growing the map when it gets too full
+ */
+void map_put(block_map_t *map, uint32_t key, uint64_t value)
+{
+    uint64_t slot = map_slot(map, key);
+    if (map->keys[slot] == key)
+    {
+        map->values[slot] = value;
+        return;
+    }
+
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->count++;
+
+    // Keep the load factor below one half
+    if (map->count * 2 > map->mask)
+    {
+        block_map_t old = *map;
+        map_init(map, old.count * 2);
+
+        for (uint64_t i = 0; i <= old.mask; i++)
+        {
+            if (old.keys[i] != MAP_EMPTY)
+            {
+                map_put(map, old.keys[i], old.values[i]);
+            }
+        }
+
+        map_free(&old);
+    }
+}
+
+/**
+ * Removes the given key. The following entries are shifted back so that
+ * no lookup ever stops early at the removed slot.
+ */
+void map_remove(block_map_t *map, uint32_t key)
+{
+    uint64_t slot = map_slot(map, key);
+    if (map->keys[slot] != key)
+    {
+        return;
+    }
+
+    map->count--;
+
+    for (uint64_t next = (slot + 1) & map->mask; map->keys[next] != MAP_EMPTY; next = (next + 1) & map->mask)
+    {
+        // Only move entries whose home slot is not between the hole and them
+        uint64_t home = hll_hash(map->keys[next]) & map->mask;
+        if (((next - home) & map->mask) >= ((next - slot) & map->mask))
+        {
+            map->keys[slot] = map->keys[next];
+            map->values[slot] = map->values[next];
+            slot = next;
+        }
+    }
+
+    map->keys[slot] = MAP_EMPTY;
+}
+
+/**
+ * Creates an OPT cache with the given amount of lines
+ */
+void opt_init(opt_cache_t *cache, uint32_t capacity)
+{
+    memset(cache, 0, sizeof(opt_cache_t));
+    cache->capacity = capacity;
+    cache->keys = malloc(sizeof(uint32_t) * capacity);
+    cache->next_use = malloc(sizeof(uint64_t) * capacity);
+    cache->heap = malloc(sizeof(uint32_t) * capacity);
+    cache->position = malloc(sizeof(uint32_t) * capacity);
+    map_init(&cache->lines, capacity);
+}
+
+void opt_free(opt_cache_t *cache)
+{
+    free(cache->keys);
+    free(cache->next_use);
+    free(cache->heap);
+    free(cache->position);
+    map_free(&cache->lines);
+}
+
+void opt_swap(opt_cache_t *cache, uint32_t a, uint32_t b)
+{
+    uint32_t line = cache->heap[a];
+    cache->heap[a] = cache->heap[b];
+    cache->heap[b] = line;
+    cache->position[cache->heap[a]] = a;
+    cache->position[cache->heap[b]] = b;
+}
+
+void opt_sift_up(opt_cache_t *cache, uint32_t position)
+{
+    while (position > 0)
+    {
+        uint32_t parent = (position - 1) / 2;
+        if (cache->next_use[cache->heap[parent]] >= cache->next_use[cache->heap[position]])
+        {
+            break;
+        }
+
+        opt_swap(cache, parent, position);
+        position = parent;
+    }
+}
+
+void opt_sift_down(opt_cache_t *cache, uint32_t position)
+{
+    while (true)
+    {
+        uint32_t largest = position;
+        uint32_t left = position * 2 + 1;
+        uint32_t right = left + 1;
+
+        if (left < cache->used && cache->next_use[cache->heap[left]] > cache->next_use[cache->heap[largest]])
+        {
+            largest = left;
+        }
+        if (right < cache->used && cache->next_use[cache->heap[right]] > cache->next_use[cache->heap[largest]])
+        {
+            largest = right;
+        }
+        if (largest == position)
+        {
+            return;
+        }
+
+        opt_swap(cache, position, largest);
+        position = largest;
+    }
+}
+
+/**
+ * Simulates an access to the given block in an OPT cache, where next_use
+ * is the index of the next access to the same block
+ */
+void opt_access(opt_cache_t *cache, uint32_t key, uint64_t next_use)
+{
+    cache->statistics.accesses++;
+
+    uint64_t *line = map_get(&cache->lines, key);
+    if (line)
+    {
+        // The next use only moves further away, so the line can only move up
+        cache->statistics.hits++;
+        cache->next_use[*line] = next_use;
+        opt_sift_up(cache, cache->position[*line]);
+        return;
+    }
+
+    if (cache->used < cache->capacity)
+    {
+        uint32_t free_line = cache->used++;
+        cache->keys[free_line] = key;
+        cache->next_use[free_line] = next_use;
+        cache->heap[free_line] = free_line;
+        cache->position[free_line] = free_line;
+        map_put(&cache->lines, key, free_line);
+        opt_sift_up(cache, free_line);
+        return;
+    }
+
+    // Replace the line that is used furthest in the future
+    uint32_t victim = cache->heap[0];
+    map_remove(&cache->lines, cache->keys[victim]);
+    cache->keys[victim] = key;
+    cache->next_use[victim] = next_use;
+    map_put(&cache->lines, key, victim);
+    opt_sift_down(cache, 0);
+}
+
+/**
+ * Spills a batch of decoded records to the OPT trace. Accesses spanning
+ * several blocks are stored as one record per block.
+ */
+void opt_spill(opt_trace_t *trace, trace_batch_t *batch)
+{
+    cache_t geometry = {.bits_offset = trace->bits_offset};
+
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        mem_access_t access = batch->runs[i].access;
+        uint32_t cache_id = (trace->split && access.accesstype == data) ? 1 : 0;
+        uint32_t span = get_block_span(geometry, access);
+
+        for (uint32_t j = 0; j < span; j++)
+        {
+            uint32_t block = get_block_part(geometry, access, j).address >> trace->bits_offset;
+            uint32_t key = (block << 1) | cache_id;
+            fwrite(&key, sizeof(key), 1, trace->keys);
+        }
+
+        trace->count += span;
+        trace->repeats[cache_id] += batch->runs[i].repeats;
+    }
+}
+
+/**
+ * Runs Belady's MIN over the spilled trace. A backward pass finds the
+ * next use of every record, which is spilled to a second file, and a
+ * forward pass then simulates the caches. Both passes work on memory
+ * mapped files one chunk at a time, so only the map of distinct blocks
+ * and the caches themselves need to stay in memory.
+ */
+void opt_simulate(opt_trace_t *trace, opt_cache_t *caches)
+{
+    fflush(trace->keys);
+    if (trace->count == 0)
+    {
+        return;
+    }
+
+    FILE *next_file = tmpfile();
+    if (!next_file || ftruncate(fileno(next_file), trace->count * sizeof(uint64_t)) != 0)
+    {
+        printf("Unable to create the next use file\n");
+        exit(1);
+    }
+
+    uint32_t *keys = mmap(NULL, trace->count * sizeof(uint32_t), PROT_READ, MAP_SHARED, fileno(trace->keys), 0);
+    uint64_t *next_use = mmap(NULL, trace->count * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fileno(next_file), 0);
+    if (keys == MAP_FAILED || next_use == MAP_FAILED)
+    {
+        printf("Unable to map the OPT trace to memory\n");
+        exit(1);
+    }
+
+    // Backward pass. The map holds the index of the closest later access
+    // to every block seen so far.
+    block_map_t last_seen;
+    map_init(&last_seen, 1 << 16);
+
+    uint64_t chunks = (trace->count + OPT_CHUNK - 1) / OPT_CHUNK;
+    for (uint64_t chunk = chunks; chunk-- > 0;)
+    {
+        uint64_t start = chunk * OPT_CHUNK;
+        uint64_t end = (start + OPT_CHUNK < trace->count) ? start + OPT_CHUNK : trace->count;
+
+        for (uint64_t i = end; i-- > start;)
+        {
+            uint64_t *seen = map_get(&last_seen, keys[i]);
+            next_use[i] = seen ? *seen : OPT_NEVER;
+            map_put(&last_seen, keys[i], i);
+        }
+
+        // The pages are backed by the files, so nothing is lost here
+        madvise(&keys[start], (end - start) * sizeof(uint32_t), MADV_DONTNEED);
+        madvise(&next_use[start], (end - start) * sizeof(uint64_t), MADV_DONTNEED);
+    }
+
+    map_free(&last_seen);
+
+    // Forward pass
+    for (uint64_t chunk = 0; chunk < chunks; chunk++)
+    {
+        uint64_t start = chunk * OPT_CHUNK;
+        uint64_t end = (start + OPT_CHUNK < trace->count) ? start + OPT_CHUNK : trace->count;
+
+        for (uint64_t i = start; i < end; i++)
+        {
+            opt_access(&caches[keys[i] & 1], keys[i], next_use[i]);
+        }
+
+        madvise(&keys[start], (end - start) * sizeof(uint32_t), MADV_DONTNEED);
+        madvise(&next_use[start], (end - start) * sizeof(uint64_t), MADV_DONTNEED);
+    }
+
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        caches[i].statistics.accesses += trace->repeats[i];
+        caches[i].statistics.hits += trace->repeats[i];
+    }
+
+    munmap(keys, trace->count * sizeof(uint32_t));
+    munmap(next_use, trace->count * sizeof(uint64_t));
+    fclose(next_file);
+}
+
+/**
+ * Simulates the records queued for a single shard, one batch after the
+ * other, until the whole trace has been handed out. Intended to be run in
+ * a separate thread.
+ */
+void *simulate_shard(void *arg)
+{
+    shard_t *shard = arg;
+    shard_queue_t *queue = shard->queue;
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->published == shard->done && !queue->finished)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        bool empty = queue->published == shard->done;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (empty)
+        {
+            return NULL;
+        }
+
+        PROFILE_START(busy_start);
+
+        uint32_t slot = shard->done % SHARD_QUEUE;
+        for (uint32_t i = 0; i < shard->counts[slot]; i++)
+        {
+            mem_run_t run = shard->runs[slot][i];
+
+            cache_t *target = (run.access.accesstype == instruction) ? shard->cache->instructions : shard->cache->data;
+            cache_stat_t *target_statistics = (run.access.accesstype == instruction) ? &shard->instructions : &shard->data;
+
+            shard->statistics.accesses++;
+            target_statistics->accesses++;
+
+            if (probe_dm(target, run.access, shard->statistics.accesses))
+            {
+                shard->statistics.hits++;
+                target_statistics->hits++;
+            }
+
+            shard->statistics.accesses += run.repeats;
+            shard->statistics.hits += run.repeats;
+            target_statistics->accesses += run.repeats;
+            target_statistics->hits += run.repeats;
+        }
+
+        PROFILE_STOP(busy_start, shard->busy_ticks);
+
+        pthread_mutex_lock(&queue->lock);
+        shard->done++;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+ * Starts a thread for every shard, waiting for batches to simulate
+ */
+void start_shards(cache_total_t *cache, shard_t *shards, uint32_t threads, shard_queue_t *queue)
+{
+    memset(queue, 0, sizeof(shard_queue_t));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        shards[i].cache = cache;
+        shards[i].queue = queue;
+        if (pthread_create(&shards[i].thread, NULL, simulate_shard, &shards[i]) != 0)
+        {
+            printf("Unable to start simulation thread\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Hands a batch to the shard threads by partitioning the records by their
+ * set index. Every shard owns a contiguous range of the cache lines, so the
+ * threads never touch the same line. The relative order of the records
+ * within a shard is kept, which makes the result identical to a serial run.
+ * Returns as soon as the records are queued, so the next batch can be
+ * decoded while the shards simulate this one.
+ */
+void simulate_parallel(cache_total_t *cache, cache_stat_t *statistics, shard_t *shards, uint32_t threads,
+                       shard_queue_t *queue, trace_batch_t *batch)
+{
+    // Both caches have the same geometry, so the sets can be split the same way
+    uint32_t sets_per_shard = (cache->data->blocks + threads - 1) / threads;
+    uint64_t number = queue->published;
+    uint32_t slot = number % SHARD_QUEUE;
+
+    // Wait for every shard to be done with the batch that used this slot
+    pthread_mutex_lock(&queue->lock);
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        while (shards[i].done + SHARD_QUEUE <= number)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        shards[i].counts[slot] = 0;
+    }
+
+    // Accesses spanning several blocks may touch sets of different shards,
+    // so they are split up front
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        mem_run_t run = batch->runs[i];
+        uint32_t span = get_block_span(*cache->data, run.access);
+
+        // The split counts are only ever touched by this thread
+        if (span > 1)
+        {
+            cache_t *target = (run.access.accesstype == instruction) ? cache->instructions : cache->data;
+            statistics->splits++;
+            target->statistics.splits++;
+        }
+
+        for (uint32_t j = 0; j < span; j++)
+        {
+            mem_run_t part = run;
+            part.access = get_block_part(*cache->data, run.access, j);
+
+            shard_t *shard = &shards[get_index(*cache->data, part.access) / sets_per_shard];
+            if (shard->counts[slot] == shard->capacity[slot])
+            {
+                shard->capacity[slot] = shard->capacity[slot] ? 2 * shard->capacity[slot] : BATCH_SIZE / threads + 1;
+                shard->runs[slot] = realloc(shard->runs[slot], sizeof(mem_run_t) * shard->capacity[slot]);
+            }
+            shard->runs[slot][shard->counts[slot]++] = part;
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->published++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Lets the shard threads finish the queued batches and waits for them
+ */
+void stop_shards(shard_t *shards, uint32_t threads, shard_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->finished = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        pthread_join(shards[i].thread, NULL);
+#ifdef CACHE_SIM_PROFILE
+        profile.shard_ticks += shards[i].busy_ticks;
+#endif
+        for (uint32_t j = 0; j < SHARD_QUEUE; j++)
+        {
+            free(shards[i].runs[j]);
+        }
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
+
+void init_lines(trace_lines_t *lines)
+{
+    memset(lines, 0, sizeof(trace_lines_t));
+    lines->text = malloc(LINE_BUFFER);
+    lines->starts = malloc(sizeof(uint32_t) * BATCH_SIZE);
+}
+
+/**
+ * Adds the profiling counters of the given lines to the totals and
+ * releases them
+ */
+void free_lines(trace_lines_t *lines)
+{
+#ifdef CACHE_SIM_PROFILE
+    profile.read_ticks += lines->read_ticks;
+    profile.parse_ticks += lines->parse_ticks;
+#endif
+    free(lines->text);
+    free(lines->starts);
+}
+
+/**
+ * Reads up to a batch worth of lines from the trace file, once every line
+ * read before has been decoded. Returns false at the end of the file.
+ */
+bool read_lines(FILE *ptr_file, trace_lines_t *lines)
+{
+    PROFILE_START(read_start);
+
+    lines->used = 0;
+    lines->count = 0;
+    lines->next = 0;
+    while (lines->count < BATCH_SIZE && lines->used + LINE_LENGTH <= LINE_BUFFER &&
+           fgets(lines->text + lines->used, LINE_LENGTH, ptr_file) != NULL)
+    {
+        lines->starts[lines->count++] = lines->used;
+        lines->used += strlen(lines->text + lines->used) + 1;
+    }
+
+    PROFILE_STOP(read_start, lines->read_ticks);
+    return lines->count > 0;
+}
+
+/* Decodes a memory access from the given line of the trace file and returns
+ * 1) access type (instruction or data access
+ * 2) memory address
+ * 3) access size in bytes, which is optional and defaults to 1
+ */
+mem_access_t parse_transaction(char *line, uint64_t number)
+{
+    char *token;
+    char *string = line;
+    mem_access_t access = {0};
+
+    /* Get the access type */
+    token = strsep(&string, " \n");
+    if (strcmp(token, "I") == 0)
+    {
+        access.accesstype = instruction;
+    }
+    else if (strcmp(token, "D") == 0)
+    {
+        access.accesstype = data;
+    }
+    else
+    {
+        printf("Unkown access type\n");
+        exit(0);
+    }
+
+    /* Get the access type */
+    token = strsep(&string, " \n");
+    access.address = (uint32_t)strtol(token, NULL, 16);
+
+    /* Get the access size */
+    token = strsep(&string, " \n");
+    access.size = 1;
+    if (token != NULL && *token != '\0')
+    {
+        // Anything larger would make the block span computation overflow
+        char *end;
+        long size = strtol(token, &end, 10);
+        if (end == token || size <= 0 || size > MAX_ACCESS_SIZE)
+        {
+            printf("Invalid access size %s on line %" PRIu64 ", expected 1-%d bytes\n", token, number, MAX_ACCESS_SIZE);
+            exit(0);
+        }
+        access.size = size;
+    }
+
+    return access;
+}
+
+/**
+ * Reads the next batch of records from the trace file. If coalescing is
+ * enabled, consecutive accesses to the same block from the same stream
+ * are collapsed into a single run. Returns the amount of records read,
+ * which is 0 once the whole trace has been read or a record with the
+ * address 0 was found. Lines that do not fit in the batch are kept for
+ * the next one.
+ */
+uint32_t read_batch(FILE *ptr_file, trace_lines_t *lines, trace_batch_t *batch)
+{
+    // Index of the last record of each stream in this batch, or -1 if
+    // there is none. With a unified cache the streams share a cache, so
+    // we may only merge with the very last record.
+    int64_t last[2] = {-1, -1};
+
+    batch->count = 0;
+    while (!lines->done && batch->count < BATCH_SIZE)
+    {
+        if (lines->next == lines->count && !read_lines(ptr_file, lines))
+        {
+            lines->done = true;
+            break;
+        }
+
+        PROFILE_START(parse_start);
+
+        while (batch->count < BATCH_SIZE && lines->next < lines->count)
+        {
+            mem_access_t access = parse_transaction(lines->text + lines->starts[lines->next++], ++lines->number);
+
+            // An address of 0 ends the trace, like the end of the file
+            if (access.address == 0)
+            {
+                lines->done = true;
+                break;
+            }
+
+            batch->accesses++;
+
+            if (batch->coalesce)
+            {
+                uint32_t stream = batch->split ? access.accesstype : 0;
+                int64_t prev = last[stream];
+
+                // Accesses spanning several blocks are never merged, as the
+                // repeats of a run are assumed to touch a single block
+                uint32_t block_mask = (1 << batch->bits_offset) - 1;
+                bool single = (access.address & block_mask) + access.size <= block_mask + 1;
+
+                if (single && prev >= 0 && batch->runs[prev].access.accesstype == access.accesstype &&
+                    (batch->runs[prev].access.address & block_mask) + batch->runs[prev].access.size <= block_mask + 1 &&
+                    (batch->runs[prev].access.address >> batch->bits_offset) == (access.address >> batch->bits_offset))
+                {
+                    batch->runs[prev].repeats++;
+                    continue;
+                }
+
+                last[stream] = batch->count;
+            }
+
+            batch->runs[batch->count].access = access;
+            batch->runs[batch->count].repeats = 0;
+            batch->count++;
+        }
+
+        PROFILE_STOP(parse_start, lines->parse_ticks);
+    }
+
+    batch->records += batch->count;
+    return batch->count;
+}
+
+/**
+ * Keeps decoding batches from the trace of the given reader until the
+ * whole trace has been read. Intended to be run in a separate thread.
+ */
+void *prefetch_trace(void *arg)
+{
+    trace_reader_t *reader = arg;
+
+    for (uint32_t i = 0;; i ^= 1)
+    {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->filled[i])
+        {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        uint32_t count = read_batch(reader->file, &reader->lines, &reader->batches[i]);
+
+        pthread_mutex_lock(&reader->lock);
+        reader->filled[i] = true;
+        pthread_cond_signal(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+
+        // An empty batch tells the simulator that the trace is done
+        if (count == 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Opens the given trace file and starts prefetching it
+ */
+void start_reader(trace_reader_t *reader, const char *file, uint8_t program, uint32_t bits_offset)
+{
+    memset(reader, 0, sizeof(trace_reader_t));
+
+    reader->file = fopen(file, "r");
+    if (!reader->file)
+    {
+        printf("Unable to open the trace file %s\n", file);
+        exit(1);
+    }
+
+    // Repeats are only guaranteed to hit when nothing else runs in between,
+    // which can not be promised with other programs sharing the cache
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        reader->batches[i].runs = malloc(sizeof(mem_run_t) * BATCH_SIZE);
+        reader->batches[i].coalesce = false;
+        reader->batches[i].bits_offset = bits_offset;
+    }
+
+    init_lines(&reader->lines);
+    reader->program = program;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+
+    if (pthread_create(&reader->thread, NULL, prefetch_trace, reader) != 0)
+    {
+        printf("Unable to start reader thread\n");
+        exit(1);
+    }
+}
+
+/**
+ * Gets the next record of the trace of the given reader, waiting for the
+ * reader thread if the next batch is not decoded yet. Returns false once
+ * the whole trace has been consumed.
+ */
+bool reader_next(trace_reader_t *reader, mem_run_t *run)
+{
+    while (true)
+    {
+        trace_batch_t *batch = &reader->batches[reader->current];
+
+        if (!reader->acquired)
+        {
+            pthread_mutex_lock(&reader->lock);
+            while (!reader->filled[reader->current])
+            {
+                pthread_cond_wait(&reader->changed, &reader->lock);
+            }
+            pthread_mutex_unlock(&reader->lock);
+
+            reader->acquired = true;
+            reader->position = 0;
+        }
+
+        if (batch->count == 0)
+        {
+            return false;
+        }
+
+        if (reader->position < batch->count)
+        {
+            *run = batch->runs[reader->position++];
+            run->access.program = reader->program;
+            return true;
+        }
+
+        // Hand the batch back to the reader thread and move on to the next
+        pthread_mutex_lock(&reader->lock);
+        reader->filled[reader->current] = false;
+        pthread_cond_signal(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+
+        reader->current ^= 1;
+        reader->acquired = false;
+    }
+}
+
+/**
+ * Waits for the reader thread to finish and releases the reader
+ */
+void stop_reader(trace_reader_t *reader)
+{
+    pthread_join(reader->thread, NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+    fclose(reader->file);
+    free_lines(&reader->lines);
+    free(reader->batches[0].runs);
+    free(reader->batches[1].runs);
+}
+
+/**
+ * Adds the amount of valid lines owned by every program in the given
+ * cache to the given counters
+ */
+void count_occupancy(cache_t *cache, uint64_t *occupancy)
+{
+    for (uint32_t i = 0; i < MAX_PROGRAMS; i++)
     {
-        access = read_transaction(ptr_file);
-        //If no transactions left, break out of loop
-        if (access.address == 0)
-            break;
-        //printf("%d %x\n", access.accesstype, access.address);
+        occupancy[i] += cache->owned[i];
+    }
+}
+
+/**
+ * Gets the amount of accesses the given program may do in a single turn
+ */
+uint64_t get_turn_length(programs_t *programs, uint32_t program)
+{
+    switch (programs->schedule)
+    {
+    case weighted:
+        return programs->weights[program];
+    case timeslice:
+        return programs->quantum;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Simulates several programs sharing the same cache. Every trace is read
+ * by its own prefetching reader, and the scheduler decides how the
+ * accesses are interleaved. Lines are tagged with the program that
+ * brought them in, so programs never hit on each others data.
+ */
+void simulate_programs(cache_total_t *cache, cache_stat_t *statistics, cache_map_t map, programs_t *programs,
+                       timing_model_t *timing_model)
+{
+    trace_reader_t *readers = calloc(programs->count, sizeof(trace_reader_t));
+    bool finished[MAX_PROGRAMS] = {false};
+    uint32_t running = programs->count;
+
+    for (uint32_t i = 0; i < programs->count; i++)
+    {
+        start_reader(&readers[i], programs->files[i], i, cache->data->bits_offset);
+    }
+
+    // Keep the occupancy up to date as lines are replaced, rather than
+    // scanning every line for each sample
+    cache->data->owned = calloc(MAX_PROGRAMS, sizeof(uint64_t));
+    if (cache->instructions != cache->data)
+    {
+        cache->instructions->owned = calloc(MAX_PROGRAMS, sizeof(uint64_t));
+    }
+
+    uint32_t current = 0;
+    uint64_t turn_left = get_turn_length(programs, current);
+
+    while (running > 0)
+    {
+        mem_run_t run;
+
+        // Switch to the next program that still has accesses left
+        if (turn_left == 0 || finished[current])
+        {
+            uint32_t previous = current;
+            do
+            {
+                current = (current + 1) % programs->count;
+            } while (finished[current]);
+
+            turn_left = get_turn_length(programs, current);
+            if (current != previous)
+            {
+                programs->context_switches++;
+            }
+            continue;
+        }
+
+        if (!reader_next(&readers[current], &run))
+        {
+            finished[current] = true;
+            running--;
+            continue;
+        }
+
+        // The statistics and the FIFO order are shared between the programs,
+        // so the share of this program is found from the difference
+        cache_t *target = (run.access.accesstype == instruction) ? cache->instructions : cache->data;
+        uint64_t accesses = statistics->accesses;
+        uint64_t hits = statistics->hits;
+
+        bool hit = access_mem_run(target, statistics, run, map);
+
+        programs->statistics[current].accesses += statistics->accesses - accesses;
+        programs->statistics[current].hits += statistics->hits - hits;
+
+        if (timing_model)
+        {
+            uint32_t block = run.access.address >> target->bits_offset;
+            timing_access(timing_model, run.access.accesstype, block, hit);
+        }
+
+        if (statistics->accesses / OCCUPANCY_INTERVAL != accesses / OCCUPANCY_INTERVAL)
+        {
+            count_occupancy(cache->data, programs->occupancy);
+            if (cache->instructions != cache->data)
+            {
+                count_occupancy(cache->instructions, programs->occupancy);
+            }
+            programs->samples++;
+        }
+
+        turn_left--;
+    }
+
+    count_occupancy(cache->data, programs->final_occupancy);
+    if (cache->instructions != cache->data)
+    {
+        count_occupancy(cache->instructions, programs->final_occupancy);
+    }
+
+    for (uint32_t i = 0; i < programs->count; i++)
+    {
+        stop_reader(&readers[i]);
+    }
+
+    free(cache->data->owned);
+    cache->data->owned = NULL;
+    if (cache->instructions != cache->data)
+    {
+        free(cache->instructions->owned);
+        cache->instructions->owned = NULL;
+    }
+    free(readers);
+}
+
+void main(int argc, char **argv)
+{
+    // DECLARE CACHES AND COUNTERS FOR THE STATS HERE
+
+    uint32_t cache_size;
+    uint32_t block_size = 64;
+    cache_map_t cache_mapping;
+    cache_org_t cache_org;
+    bool coalesce = false;
+    uint32_t threads = 1;
+    bool timing = false;
+    bool compact = false;
+    working_set_t *working_set = NULL;
+    bool opt = false;
+    programs_t programs = {
+        .schedule = rr,
+        .files = {"mem_trace.txt"},
+        .quantum = 10000,
+    };
+
+    // Default timing parameters, loosely based on a modern desktop processor
+    timing_model_t timing_model = {
+        .hit_latency = 4,
+        .memory_latency = 200,
+        .memory_bandwidth = 16,
+        .mshr_count = 8,
+    };
+
+    // USE THIS FOR YOUR CACHE STATISTICS
+    cache_stat_t cache_statistics;
+
+    // Reset statistics:
+    memset(&cache_statistics, 0, sizeof(cache_stat_t));
+
+    /* Read command-line parameters and initialize:
+     * cache_size, cache_mapping and cache_org variables
+     */
+
+    if (argc < 4)
+    { /* argc should be 2 for correct execution */
+        printf("Usage: ./cache_sim [cache size: 128-4096] [cache mapping: dm|fa] [cache organization: uc|sc] [options]\n");
+        printf("Options:\n");
+        printf("  --coalesce   Merge consecutive accesses to the same block before simulating\n");
+        printf("  --threads N  Simulate a direct mapped cache in parallel using N threads\n");
+        printf("  --timing     Estimate AMAT and stall cycles using the timing model\n");
+        printf("  --compact    Store the cache lines using a compact encoding\n");
+        printf("  --wss N      Estimate the working set of every window of N accesses\n");
+        printf("  --opt        Also simulate an optimal (Belady MIN) fully associative cache\n");
+        printf("  --trace FILE Read the trace from FILE instead of mem_trace.txt. Given\n");
+        printf("               several times, the traces share the cache as separate programs\n");
+        printf("  --schedule rr|weighted|timeslice, --weights W1,W2,..., --quantum N\n");
+        printf("               Configure how the programs sharing the cache are interleaved\n");
+        printf("  --hit-latency N, --mem-latency N, --mem-bandwidth N, --mshrs N\n");
+        printf("               Configure the timing model (cycles, bytes per cycle)\n");
+        exit(0);
+    }
+    else
+    {
+        /* argv[0] is program name, parameters start with argv[1] */
 
-        /* Do a cache access */
+        /* Set cache size */
+        cache_size = atoi(argv[1]);
 
-        // If this is a unified cache these will point to the same cache
-        cache_t *target = (access.accesstype == instruction) ? cache->instructions : cache->data;
+        /* Set Cache Mapping */
+        if (strcmp(argv[2], "dm") == 0)
+        {
+            cache_mapping = dm;
+        }
+        else if (strcmp(argv[2], "fa") == 0)
+        {
+            cache_mapping = fa;
+        }
+        else
+        {
+            printf("Unknown cache mapping\n");
+            exit(0);
+        }
 
-        if (cache_mapping == dm)
+        /* Set Cache Organization */
+        if (strcmp(argv[3], "uc") == 0)
+        {
+            cache_org = uc;
+        }
+        else if (strcmp(argv[3], "sc") == 0)
         {
-            access_mem_dm(target, &cache_statistics, access);
+            cache_org = sc;
         }
         else
         {
-            access_mem_fa(target, &cache_statistics, access);
+            printf("Unknown cache organization\n");
+            exit(0);
+        }
+
+        /* Optional flags */
+        for (int i = 4; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--coalesce") == 0)
+            {
+                coalesce = true;
+            }
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            {
+                threads = atoi(argv[++i]);
+                if (threads == 0)
+                {
+                    printf("Invalid thread count %s\n", argv[i]);
+                    exit(0);
+                }
+            }
+            else if (strcmp(argv[i], "--timing") == 0)
+            {
+                timing = true;
+            }
+            else if (strcmp(argv[i], "--compact") == 0)
+            {
+                compact = true;
+            }
+            else if (strcmp(argv[i], "--wss") == 0 && i + 1 < argc)
+            {
+                working_set = calloc(1, sizeof(working_set_t));
+                working_set->window_size = strtoull(argv[++i], NULL, 10);
+                working_set->bits_offset = BIT_WIDTH(block_size);
+                if (working_set->window_size == 0)
+                {
+                    printf("Invalid window size %s\n", argv[i]);
+                    exit(0);
+                }
+            }
+            else if (strcmp(argv[i], "--opt") == 0)
+            {
+                opt = true;
+            }
+            else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            {
+                if (programs.count == MAX_PROGRAMS)
+                {
+                    printf("At most %d traces are supported\n", MAX_PROGRAMS);
+                    exit(0);
+                }
+                programs.files[programs.count++] = argv[++i];
+            }
+            else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "rr") == 0)
+                {
+                    programs.schedule = rr;
+                }
+                else if (strcmp(argv[i], "weighted") == 0)
+                {
+                    programs.schedule = weighted;
+                }
+                else if (strcmp(argv[i], "timeslice") == 0)
+                {
+                    programs.schedule = timeslice;
+                }
+                else
+                {
+                    printf("Unknown schedule %s\n", argv[i]);
+                    exit(0);
+                }
+            }
+            else if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc)
+            {
+                char *string = argv[++i];
+                char *token;
+                for (uint32_t j = 0; (token = strsep(&string, ",")) != NULL && j < MAX_PROGRAMS; j++)
+                {
+                    programs.weights[j] = atoi(token);
+                }
+            }
+            else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc)
+            {
+                programs.quantum = strtoull(argv[++i], NULL, 10);
+            }
+            else if (strcmp(argv[i], "--hit-latency") == 0 && i + 1 < argc)
+            {
+                timing_model.hit_latency = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--mem-latency") == 0 && i + 1 < argc)
+            {
+                timing_model.memory_latency = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--mem-bandwidth") == 0 && i + 1 < argc)
+            {
+                timing_model.memory_bandwidth = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--mshrs") == 0 && i + 1 < argc)
+            {
+                timing_model.mshr_count = atoi(argv[++i]);
+            }
+            else
+            {
+                printf("Unknown option %s\n", argv[i]);
+                exit(0);
+            }
+        }
+
+        // A fully associative cache only has one set, so there is nothing to
+        // split between the threads
+        if (threads > 1 && cache_mapping != dm)
+        {
+            printf("Parallel simulation requires direct mapping\n");
+            exit(0);
+        }
+
+        // The timing model depends on the global order of the accesses
+        if (threads > 1 && timing)
+        {
+            printf("The timing model can not be used with parallel simulation\n");
+            exit(0);
+        }
+
+        if (timing_model.memory_bandwidth == 0 || timing_model.mshr_count == 0 || timing_model.mshr_count > MAX_MSHRS)
+        {
+            printf("Invalid timing model parameters\n");
+            exit(0);
+        }
+
+        timing_model.transfer_cycles = (block_size + timing_model.memory_bandwidth - 1) / timing_model.memory_bandwidth;
+
+        // Fall back to the default trace if none were given
+        if (programs.count == 0)
+        {
+            programs.count = 1;
+        }
+
+        if (programs.count > 1)
+        {
+            // Compact lines have no room for the owner, the programs are
+            // interleaved in a single global order, and repeats can not be
+            // coalesced when other programs run in between
+            if (compact || threads > 1 || working_set || opt || coalesce)
+            {
+                printf("Shared cache simulation can not be combined with --compact, --threads, --wss, --opt or --coalesce\n");
+                exit(0);
+            }
+
+            for (uint32_t i = 0; i < programs.count; i++)
+            {
+                if (programs.weights[i] == 0)
+                {
+                    programs.weights[i] = 1;
+                }
+            }
+
+            if (programs.quantum == 0)
+            {
+                printf("Invalid quantum\n");
+                exit(0);
+            }
+        }
+    }
+
+    // Make caches
+    cache_total_t *cache = make_total_cache(cache_size, block_size, cache_mapping, cache_org, compact);
+
+    /* Open the file mem_trace.txt to read memory accesses */
+    // When several programs share the cache, each is opened by its reader
+    FILE *ptr_file = NULL;
+    if (programs.count == 1)
+    {
+        ptr_file = fopen(programs.files[0], "r");
+        if (!ptr_file)
+        {
+            printf("Unable to open the trace file\n");
+            exit(1);
+        }
+    }
+
+    trace_batch_t batch = {
+        .runs = malloc(sizeof(mem_run_t) * BATCH_SIZE),
+        .coalesce = coalesce,
+        // Merging across the other stream reorders the accesses between the
+        // caches, which the timing model and the working set windows are
+        // sensitive to
+        .split = cache_org == sc && !timing && !working_set,
+        .bits_offset = cache->data->bits_offset,
+    };
+
+    // Never use more threads than there are sets or processors
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors > 0 && threads > processors)
+    {
+        threads = processors;
+    }
+    if (threads > cache->data->blocks)
+    {
+        threads = cache->data->blocks;
+    }
+
+    shard_t *shards = NULL;
+    shard_queue_t shard_queue;
+    if (threads > 1)
+    {
+        shards = calloc(threads, sizeof(shard_t));
+        start_shards(cache, shards, threads, &shard_queue);
+    }
+
+    if (working_set)
+    {
+        printf("\nWorking Set (windows of %ld accesses)\n", working_set->window_size);
+        printf("-----------------\n\n");
+        printf("%8s %10s %8s %10s %8s | %10s %8s %10s %8s\n", "Window", "I Blocks", "I Pages", "D Blocks", "D Pages",
+               "I Blocks", "I Pages", "D Blocks", "D Pages");
+    }
+
+#ifdef CACHE_SIM_PROFILE
+    struct timespec profile_start_time;
+    clock_gettime(CLOCK_MONOTONIC, &profile_start_time);
+    uint64_t profile_start_ticks = PROFILE_TICKS();
+#endif
+
+    opt_trace_t opt_trace = {
+        .split = cache_org == sc,
+        .bits_offset = cache->data->bits_offset,
+    };
+    if (opt)
+    {
+        opt_trace.keys = tmpfile();
+        if (!opt_trace.keys)
+        {
+            printf("Unable to create the OPT trace file\n");
+            exit(1);
+        }
+    }
+
+    if (programs.count > 1)
+    {
+        PROFILE_START(simulate_start);
+        simulate_programs(cache, &cache_statistics, cache_mapping, &programs, timing ? &timing_model : NULL);
+        PROFILE_STOP(simulate_start, profile.simulate_ticks);
+    }
+
+    /* Loop until whole trace file has been read */
+    trace_lines_t lines;
+    init_lines(&lines);
+
+    while (ptr_file && read_batch(ptr_file, &lines, &batch) > 0)
+    {
+        PROFILE_START(simulate_start);
+
+        for (uint32_t i = 0; working_set && i < batch.count; i++)
+        {
+            working_set_add(working_set, batch.runs[i].access, (uint64_t)batch.runs[i].repeats + 1);
+        }
+
+        if (opt)
+        {
+            opt_spill(&opt_trace, &batch);
+        }
+
+        if (threads > 1)
+        {
+            simulate_parallel(cache, &cache_statistics, shards, threads, &shard_queue, &batch);
+            PROFILE_STOP(simulate_start, profile.simulate_ticks);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < batch.count; i++)
+        {
+            mem_run_t run = batch.runs[i];
+
+            /* Do a cache access */
+
+            // If this is a unified cache these will point to the same cache
+            cache_t *target = (run.access.accesstype == instruction) ? cache->instructions : cache->data;
+            bool hit = access_mem_run(target, &cache_statistics, run, cache_mapping);
+
+            if (timing)
+            {
+                uint32_t block = run.access.address >> target->bits_offset;
+                timing_access(&timing_model, run.access.accesstype, block, hit);
+                timing_repeat(&timing_model, run.access.accesstype, block, run.repeats);
+            }
         }
+
+        PROFILE_STOP(simulate_start, profile.simulate_ticks);
+    }
+
+    if (shards)
+    {
+        PROFILE_START(simulate_start);
+        stop_shards(shards, threads, &shard_queue);
+        PROFILE_STOP(simulate_start, profile.simulate_ticks);
+    }
+
+    free_lines(&lines);
+
+#ifdef CACHE_SIM_PROFILE
+    struct timespec profile_end_time;
+    clock_gettime(CLOCK_MONOTONIC, &profile_end_time);
+    uint64_t profile_total_ticks = PROFILE_TICKS() - profile_start_ticks;
+    double profile_total_ns = (profile_end_time.tv_sec - profile_start_time.tv_sec) * 1e9 +
+                              (profile_end_time.tv_nsec - profile_start_time.tv_nsec);
+#endif
+
+    // Merge the statistics of every shard. With a unified cache both
+    // pointers refer to the same cache, which then receives both shares.
+    for (uint32_t i = 0; shards && i < threads; i++)
+    {
+        cache_statistics.accesses += shards[i].statistics.accesses;
+        cache_statistics.hits += shards[i].statistics.hits;
+        cache->instructions->statistics.accesses += shards[i].instructions.accesses;
+        cache->instructions->statistics.hits += shards[i].instructions.hits;
+        cache->data->statistics.accesses += shards[i].data.accesses;
+        cache->data->statistics.hits += shards[i].data.hits;
+    }
+
+    // The last window is most likely incomplete, but report it anyway
+    if (working_set && working_set->in_window > 0)
+    {
+        working_set_close_window(working_set);
     }
 
     /* Print the statistics */
@@ -408,14 +2447,152 @@ void main(int argc, char **argv)
         printf("ICache Hit Rate: %.4f\n", (double)cache->instructions->statistics.hits / cache->instructions->statistics.accesses);
     }
 
+    // Only shown when the trace contains multi-byte accesses, after the
+    // fixed statistics so that their format stays intact
+    if (cache_statistics.splits > 0)
+    {
+        printf("\n");
+        printf("Split Accesses: %ld\n", cache_statistics.splits);
+        if (cache_org == sc)
+        {
+            printf("DCache Splits:  %ld\n", cache->data->statistics.splits);
+            printf("ICache Splits:  %ld\n", cache->instructions->statistics.splits);
+        }
+    }
+
+    if (opt)
+    {
+        // Index 0 is the unified or instruction cache, 1 the data cache
+        opt_cache_t opt_caches[2];
+        opt_init(&opt_caches[0], cache->instructions->blocks);
+        opt_init(&opt_caches[1], cache->data->blocks);
+
+        opt_simulate(&opt_trace, opt_caches);
+        fclose(opt_trace.keys);
+
+        uint64_t accesses = opt_caches[0].statistics.accesses + opt_caches[1].statistics.accesses;
+        uint64_t hits = opt_caches[0].statistics.hits + opt_caches[1].statistics.hits;
+
+        printf("\nOPT Statistics (Fully Associative, Belady MIN)\n");
+        printf("-----------------\n\n");
+        printf("Accesses: %ld\n", accesses);
+        printf("Hits:     %ld\n", hits);
+        printf("Hit Rate: %.4f\n", (double)hits / accesses);
+
+        if (cache_org == sc)
+        {
+            printf("\n");
+            printf("DCache Hits:     %ld\n", opt_caches[1].statistics.hits);
+            printf("DCache Hit Rate: %.4f\n", (double)opt_caches[1].statistics.hits / opt_caches[1].statistics.accesses);
+            printf("\n");
+            printf("ICache Hits:     %ld\n", opt_caches[0].statistics.hits);
+            printf("ICache Hit Rate: %.4f\n", (double)opt_caches[0].statistics.hits / opt_caches[0].statistics.accesses);
+        }
+
+        opt_free(&opt_caches[0]);
+        opt_free(&opt_caches[1]);
+    }
+
+    if (programs.count > 1)
+    {
+        uint64_t lines = (uint64_t)cache->data->blocks * (cache_org == sc ? 2 : 1);
+
+        printf("\nProgram Statistics\n");
+        printf("-----------------\n\n");
+        printf("%-3s %12s %12s %8s %10s %10s  %s\n", "#", "Accesses", "Hits", "Hit Rate", "Occupancy", "Final", "Trace");
+        for (uint32_t i = 0; i < programs.count; i++)
+        {
+            printf("%-3d %12ld %12ld %8.4f %9.2f%% %9.2f%%  %s\n", i, programs.statistics[i].accesses,
+                   programs.statistics[i].hits, (double)programs.statistics[i].hits / programs.statistics[i].accesses,
+                   programs.samples ? 100.0 * programs.occupancy[i] / (programs.samples * lines) : 0.0,
+                   100.0 * programs.final_occupancy[i] / lines, programs.files[i]);
+        }
+        printf("\nContext Switches: %ld\n", programs.context_switches);
+    }
+
+    if (timing)
+    {
+        // Let every outstanding miss return before reporting
+        timing_advance(&timing_model, timing_model.bus_free_at > timing_model.cycle ? timing_model.bus_free_at : timing_model.cycle);
+
+        printf("\nTiming Model\n");
+        printf("-----------------\n\n");
+        printf("Cycles:       %ld\n", timing_model.accounted_at);
+        printf("AMAT:         %.2f cycles\n", (double)timing_model.total_latency / timing_model.accesses);
+        printf("Stall Cycles: %ld\n", timing_model.stall_cycles);
+        printf("MSHR Merges:  %ld\n", timing_model.merges);
+        printf("MSHR Occupancy:\n");
+        for (uint32_t i = 0; i <= timing_model.mshr_count; i++)
+        {
+            printf("  %2d: %12ld cycles (%6.2f%%)\n", i, timing_model.occupancy[i],
+                   100.0 * timing_model.occupancy[i] / timing_model.accounted_at);
+        }
+    }
+
+    if (compact)
+    {
+        uint64_t lines = (uint64_t)cache->data->blocks * (cache_org == sc ? 2 : 1);
+        printf("\n");
+        printf("Line Size:     %d bytes (%ld regular)\n", cache->data->line_width, sizeof(cache_line_t));
+        printf("Line Metadata: %ld bytes (%ld regular)\n", lines * cache->data->line_width, lines * sizeof(cache_line_t));
+    }
+
+#ifdef CACHE_SIM_PROFILE
+    {
+        double ns_per_tick = profile_total_ns / profile_total_ticks;
+        // With several traces the readers run alongside the simulation, so
+        // the shares may add up to more than the total
+        uint64_t measured_ticks = profile.read_ticks + profile.parse_ticks + profile.simulate_ticks;
+        uint64_t other_ticks = profile_total_ticks > measured_ticks ? profile_total_ticks - measured_ticks : 0;
+
+        printf("\nProfile\n");
+        printf("-----------------\n\n");
+        printf("Read:       %10.3f ms (%5.1f%%)\n", profile.read_ticks * ns_per_tick / 1e6, 100.0 * profile.read_ticks / profile_total_ticks);
+        printf("Parse:      %10.3f ms (%5.1f%%)\n", profile.parse_ticks * ns_per_tick / 1e6, 100.0 * profile.parse_ticks / profile_total_ticks);
+        printf("Simulate:   %10.3f ms (%5.1f%%)\n", profile.simulate_ticks * ns_per_tick / 1e6, 100.0 * profile.simulate_ticks / profile_total_ticks);
+        printf("Other:      %10.3f ms (%5.1f%%)\n", other_ticks * ns_per_tick / 1e6, 100.0 * other_ticks / profile_total_ticks);
+        printf("Total:      %10.3f ms\n", profile_total_ns / 1e6);
+        if (shards)
+        {
+            // Runs alongside the above, so it is not part of the total
+            printf("Shards:     %10.3f ms busy in %u threads\n", profile.shard_ticks * ns_per_tick / 1e6, threads);
+        }
+        if (cache_statistics.accesses > 0)
+        {
+            printf("ns/access:  %10.2f (%.2f simulating)\n", profile_total_ns / cache_statistics.accesses,
+                   profile.simulate_ticks * ns_per_tick / cache_statistics.accesses);
+        }
+
+        if (profile.probed_accesses > 0)
+        {
+            printf("FA Probes:  %10ld (%.2f lines/access)\n", profile.probes, (double)profile.probes / profile.probed_accesses);
+        }
+    }
+#endif
+
+    if (coalesce)
+    {
+        printf("\n");
+        printf("Coalesced Accesses: %ld\n", batch.accesses);
+        printf("Coalesced Records:  %ld\n", batch.records);
+        printf("Compression Ratio:  %.2fx\n", (double)batch.accesses / batch.records);
+    }
+
     /* Close the trace file */
-    fclose(ptr_file);
+    if (ptr_file)
+    {
+        fclose(ptr_file);
+    }
 
-    free(cache);
+    free(batch.runs);
+    free(shards);
+    free(working_set);
     free(cache->data);
 
     if (cache_org == sc)
     {
         free(cache->instructions);
     }
+
+    free(cache);
 }
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Checks that a record with the address 0 ends the whole simulation, no
+# matter where it falls relative to the batches the trace is read in.
+# Usage: ./test_trace_end.sh (from any directory)
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+gcc -O2 -o "$dir/cache_sim" "$(dirname "$0")/cache_sim.c" -lm -lpthread || exit 1
+
+failed=0
+
+# Writes a trace of 100000 records with the address 0 on the given line and
+# expects every record before it to be simulated
+check()
+{
+    awk -v zero="$1" 'BEGIN {
+        for (i = 1; i <= 100000; i++)
+            printf("%s %x\n", i % 3 ? "D" : "I", i == zero ? 0 : i * 64);
+    }' > "$dir/trace.txt"
+
+    for options in "1024 dm uc" "1024 dm sc --coalesce" "1024 fa uc"; do
+        accesses=$("$dir/cache_sim" $options --trace "$dir/trace.txt" | sed -n 's/^Accesses: //p')
+        if [ "$accesses" != "$(($1 - 1))" ]; then
+            echo "FAIL: 0 on line $1 with $options simulated $accesses accesses, expected $(($1 - 1))"
+            failed=1
+        fi
+    done
+}
+
+check 70000  # In the middle of the second batch
+check 65537  # First record of the second batch
+check 2      # Right at the start
+
+[ $failed -eq 0 ] && echo "OK"
+exit $failed
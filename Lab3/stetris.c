@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,6 +13,16 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 // The game state can be used to detect what happens on the playfield
 #define GAMEOVER 0
@@ -24,13 +35,35 @@
 // Converts RGB888 to RGB565 by grabbing most significant bits of each color
 #define RGB(r, g, b) (((r & 0xF8) << 8) + ((g & 0xFC) << 3) + (b >> 3))
 
-// If you extend this structure, either avoid pointers or adjust
-// the game logic allocate/deallocate and reset the memory
-typedef struct
-{
-    bool occupied;
-    u_int16_t color; // This is the color value (raw RGB565) for this tile
-} tile;
+// The playfield is stored as a bitboard, with one word per row where bit x
+// is set when tile x of the row is occupied. This bounds the grid width.
+typedef u_int64_t row_bits;
+#define MAX_GRID_WIDTH (sizeof(row_bits) * 8)
+
+// Input latency is kept in a log-linear histogram of microseconds: exact
+// below 16 us, then 16 buckets per power of two (within 1/16 of the value)
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (61 * LATENCY_SUB_BUCKETS)
+
+// Capacity of the key queue between the input thread and the game, a power
+// of two
+#define KEY_QUEUE_SIZE 256
+#define CACHE_LINE 64
+
+// Session logs start with the magic and version, followed by the grid size
+// and the seed. Then come records, each starting with a varint holding the
+// steps since the previous record shifted left by 3, and the record type
+// in the low 3 bits: a key, a playfield snapshot, or the end of the session
+// with the final stats.
+#define SESSION_MAGIC "STRS"
+#define SESSION_VERSION 1
+#define SESSION_SNAPSHOT_INTERVAL (1 << 16)
+#define SESSION_SNAPSHOT 0
+#define SESSION_KEY_LEFT 1
+#define SESSION_KEY_RIGHT 2
+#define SESSION_KEY_DOWN 3
+#define SESSION_KEY_OTHER 4 // any other key plays like KEY_UP
+#define SESSION_END 7
 
 typedef struct
 {
@@ -38,9 +71,18 @@ typedef struct
     unsigned int y;
 } coord;
 
+// Tiles changed since the last frame was rendered, so that rendering only
+// has to touch those. Filled by the playfield helpers.
+typedef struct
+{
+    bool *flags;        // One flag per tile, set while the tile is listed
+    coord *tiles;       // The changed tiles, in the order they changed
+    unsigned int count;
+} dirty_tiles_t;
+
 typedef struct
 {
-    coord const grid;                     // playfield bounds
+    coord grid;                           // playfield bounds
     unsigned long const uSecTickTime;     // tick rate
     unsigned long const rowsPerLevel;     // speed up after clearing rows
     unsigned long const initNextGameTick; // initial value of nextGameTick
@@ -50,11 +92,16 @@ typedef struct
     unsigned int score;      // game score
     unsigned int level;      // game level
     unsigned int colorIndex; // The current index of the color to use
+    unsigned int games;      // number of games started
 
-    tile *rawPlayfield; // pointer to raw memory of the playfield
-    tile **playfield;   // This is the play field array
+    row_bits *occupied; // occupancy bitboard, one word per row
+    row_bits fullRow;   // value of a row where every tile is occupied
+    u_int16_t *colors;  // color (raw RGB565) of every tile, row by row.
+                        // 0 (i. e. off) for every unoccupied tile
     unsigned int state;
     coord activeTile; // current tile
+    dirty_tiles_t *dirty; // tiles changed since the last frame, or NULL if
+                          // nothing renders this board
 
     unsigned long tick;         // incremeted at tickrate, wraps at nextGameTick
                                 // when reached 0, next game state calculated
@@ -62,22 +109,179 @@ typedef struct
                                 // lowers with increasing level, never reaches 0
 } gameConfig;
 
-// Pointers and information for controlling the Sensehat LED matrix
+// Pointers and information for controlling the Sensehat LED matrix, or the
+// virtual framebuffer standing in for it. Frames are drawn into an
+// off-screen copy of the framebuffer and presented with a single copy of
+// the lines that changed, so a frame is never seen half drawn.
 typedef struct
 {
+    char const *devicePath; // framebuffer to use, or NULL to look it up
     int filedesc;
-    u_int16_t *pixels;
+    u_int16_t *pixels;      // the framebuffer memory
+    u_int16_t *frame;       // off-screen frame, laid out like pixels
     u_int32_t screen_bytes;
+    unsigned int stride;    // pixels per line
+    unsigned int originX;   // pixel of the top left tile
+    unsigned int originY;
+    unsigned int scale;     // pixels per tile side
+    unsigned int changedTop;    // lines drawn since the last present,
+    unsigned int changedBottom; // none when changedTop > changedBottom
     struct fb_fix_screeninfo fix_info;
     struct fb_var_screeninfo var_info;
 } sensehat_ctl_t;
 
+// A framebuffer in a file, or in memory if there is no path, for running
+// without the Sense HAT
+typedef struct
+{
+    bool enabled;
+    char const *path;
+    unsigned int width;
+    unsigned int height;
+} virtual_fb_t;
+
 // Information needed to read input from the Sensehat joystick
 typedef struct
 {
-    int filedesc;
+    char const *devicePath;    // event device to use, or NULL to look it up
+    int filedesc;              // -1 when there is no joystick
+    clockid_t clock;           // clock of the kernel event timestamps
+    struct timespec eventTime; // timestamp of the last press returned
 } sensehat_joystick_t;
 
+// Bytes read from the keyboard and the state of the escape sequence being
+// parsed, which may be split across reads
+typedef struct
+{
+    unsigned char buffer[64];
+    ssize_t length;
+    ssize_t offset;
+    unsigned int escape; // bytes of an ESC [ sequence seen so far
+    bool closed;         // stdin reached its end or failed
+} keyboard_ctl_t;
+
+typedef enum
+{
+    INPUT_JOYSTICK,
+    INPUT_KEYBOARD
+} input_source_t;
+
+// A key press and when it happened. Joystick presses carry the kernel event
+// timestamp, keyboard presses the time they were read.
+typedef struct
+{
+    int key;
+    input_source_t source;
+    struct timespec time;
+} key_event_t;
+
+// Lock-free single-producer/single-consumer ring of key presses. The input
+// thread only writes head and the game only writes tail, each on its own
+// cache line.
+typedef struct
+{
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) key_event_t events[KEY_QUEUE_SIZE];
+} key_queue_t;
+
+// The thread reading the joystick and the keyboard. wakefd tells the game
+// that keys were queued, stopfd tells the thread to exit.
+typedef struct
+{
+    pthread_t thread;
+    int wakefd;
+    int stopfd;
+    atomic_bool stop;
+} input_thread_t;
+
+// Time from a joystick press (the kernel event timestamp) until the LED
+// matrix has been written with its result
+typedef struct
+{
+    u_int64_t counts[LATENCY_BUCKETS];
+    u_int64_t samples;
+    u_int64_t max; // microseconds
+} latency_histogram_t;
+
+// State of the console output. Every frame is built in the buffer and
+// written with a single write(), and only what changed is redrawn.
+typedef struct
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+    bool drawn; // Whether the border and labels have been drawn
+    unsigned int tiles;
+    unsigned int rows;
+    unsigned int score;
+    unsigned int level;
+    bool gameOver;
+} console_ctl_t;
+
+// Settings of a headless run. The engine is stepped back to back, without
+// waiting for ticks, from a key stream that is either generated from a seed
+// or read from a script, so the same settings always play the same game.
+typedef struct
+{
+    bool enabled;
+    unsigned long ticks; // number of ticks to run
+    u_int64_t seed;      // seed of the generated key stream
+    char const *scriptPath;
+    int *script;         // one key (or 0) per tick, repeated when exhausted
+    size_t scriptLength;
+    unsigned int boards;  // when set, step this many boards as a batch
+    unsigned int threads; // worker threads of a batch run
+    char const *replayPath;
+    unsigned long seek; // step to stop a replay at
+    bool hasSeek;
+} headless_t;
+
+// Recording of the session being played. Every step is counted, and only
+// keys are written, so idle steps cost nothing.
+typedef struct
+{
+    char const *path;
+    FILE *file;
+    unsigned long step;     // steps played so far
+    unsigned long lastStep; // step of the last record
+} session_recorder_t;
+
+// A batch of boards stepped together, kept as a structure of arrays: every
+// field is an array over the boards, and the playfield rows are interleaved
+// so that row y of every board is contiguous. Batch boards follow the rules
+// of sTetris(), but only track occupancy, not tile colors.
+typedef struct
+{
+    gameConfig const *rules; // grid, fullRow, rowsPerLevel, initNextGameTick
+    unsigned int count;
+    unsigned int stride; // count rounded up to whole cache lines of rows
+    row_bits *occupied;  // occupied[y * stride + board]
+    unsigned int *state;
+    unsigned int *games;
+    unsigned int *tiles;
+    unsigned int *rows;
+    unsigned int *score;
+    unsigned int *level;
+    unsigned long *tick;
+    unsigned long *nextGameTick;
+    coord *activeTile;
+    u_int8_t *rowFull; // scratch: whether the bottom row is full
+    u_int64_t *random; // key stream of every board
+    int *keys;         // keys of the current step
+} board_batch_t;
+
+// One slice of a batch, stepped by one worker thread
+typedef struct
+{
+    pthread_t thread;
+    board_batch_t *batch;
+    unsigned int begin;
+    unsigned int end;
+    unsigned long steps;
+    bool joinable; // false if the slice was stepped on the main thread
+} batch_worker_t;
+
 gameConfig game = {
     .grid = {8, 8},
     .uSecTickTime = 10000,
@@ -86,177 +290,274 @@ gameConfig game = {
 };
 
 sensehat_ctl_t sensehat_ctl;
-sensehat_joystick_t sensehat_joystick;
+virtual_fb_t virtual_fb;
+sensehat_joystick_t sensehat_joystick = {.filedesc = -1};
+dirty_tiles_t dirty_tiles;
+console_ctl_t console_ctl;
+latency_histogram_t input_latency;
+keyboard_ctl_t keyboard_ctl;
+key_queue_t key_queue;
+input_thread_t input_thread;
+session_recorder_t session_recorder;
+
+// Set from signal handlers and picked up by the event loop
+volatile sig_atomic_t latencyDumpRequested;
+volatile sig_atomic_t quitRequested;
 
 // The default tetris color scheme. Fetched from
 // https://www.schemecolor.com/tetris-game-color-scheme.php
 u_int16_t COLORS[] = {RGB(3, 65, 174), RGB(114, 203, 59), RGB(255, 213, 0), RGB(255, 151, 28), RGB(255, 50, 19)};
 u_int16_t COLOR_COUNT = sizeof(COLORS) / sizeof(u_int16_t);
 
-// Converts game x, y coordinates to the correct memory offset to
-// display on the sensehat LED display
-u_int32_t getLocation(u_int8_t x, u_int8_t y)
-{
-    // Inverted x and y coordinates so that it is natural to play using
-    // the joystick with the right thumb. This makes it so the tiles
-    // fall towards the side with the power port.
-    return y + sensehat_ctl.var_info.xoffset + (x + sensehat_ctl.var_info.yoffset) * sensehat_ctl.var_info.xres;
-}
-
 // Clears (Turns off) the entire LED display matrix
 void clearPixels()
 {
+    memset(sensehat_ctl.frame, 0, sensehat_ctl.screen_bytes);
     memset(sensehat_ctl.pixels, 0, sensehat_ctl.screen_bytes);
+    sensehat_ctl.changedTop = 1;
+    sensehat_ctl.changedBottom = 0;
 }
 
-// Finds and initializes the sensehat joystick if it is present on the system
-bool initializeSenseHatJoystick()
+// Fits the playfield onto a framebuffer of width by height pixels, starting
+// at the given offset, with every tile drawn as a square of whole pixels,
+// and allocates the off-screen frame
+static bool setupFrame(unsigned int const width, unsigned int const height, unsigned int const stride,
+                       unsigned int const xoffset, unsigned int const yoffset)
 {
-    DIR *dir;
-    struct dirent *entry;
-
-    dir = opendir("/dev/input");
+    unsigned int const scaleX = width / game.grid.x;
+    unsigned int const scaleY = height / game.grid.y;
+    unsigned int const scale = scaleX < scaleY ? scaleX : scaleY;
+    if (scale == 0)
+    {
+        printf("Grid is too large for the display! Grid is %u by %u, only support for %u by %u\n",
+               game.grid.x, game.grid.y, width, height);
+        return false;
+    }
 
-    // Unable to open directory
-    if (!dir)
+    sensehat_ctl.frame = (u_int16_t *)malloc(sensehat_ctl.screen_bytes);
+    if (!sensehat_ctl.frame)
     {
+        printf("Unable to allocate the off-screen frame\n");
         return false;
     }
+    sensehat_ctl.stride = stride;
+    sensehat_ctl.scale = scale;
+    sensehat_ctl.originX = xoffset + (width - game.grid.x * scale) / 2;
+    sensehat_ctl.originY = yoffset + (height - game.grid.y * scale) / 2;
+    return true;
+}
+
+// Copies the lines drawn since the last present to the framebuffer
+static void presentFrame()
+{
+    if (sensehat_ctl.changedTop > sensehat_ctl.changedBottom)
+        return;
 
-    char file_path[64];
-    char name[512];
+    size_t const offset = (size_t)sensehat_ctl.changedTop * sensehat_ctl.stride;
+    size_t const lines = sensehat_ctl.changedBottom - sensehat_ctl.changedTop + 1;
+    memcpy(&sensehat_ctl.pixels[offset], &sensehat_ctl.frame[offset], lines * sensehat_ctl.stride * sizeof(u_int16_t));
+    sensehat_ctl.changedTop = 1;
+    sensehat_ctl.changedBottom = 0;
+}
 
-    printf("Scanning /dev/input for sensehat joystick...\n");
-    while ((entry = readdir(dir)) != NULL)
+// Looks a device up by name through sysfs, which is much faster than
+// opening and querying every device node. Every entry of classDir starting
+// with prefix has its name read from nameFile below it, and the node of the
+// first match in devDir is written to path.
+static bool findDeviceByName(char const *classDir, char const *prefix, char const *nameFile,
+                             char const *devDir, char const *name, char *path, size_t size)
+{
+    DIR *dir = opendir(classDir);
+    if (!dir)
     {
-        strcpy(file_path, "/dev/input/");
-        strcat(file_path, (char *)&entry->d_name);
+        return false;
+    }
 
-        printf("Opening file descriptor of %s\n", file_path);
-        int filedesc = open(file_path, O_RDONLY | O_NONBLOCK); // Only need read access here
-        if (filedesc == -1)
+    bool found = false;
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)))
         {
-            printf("Error occurred while opening file descriptor %s\n", file_path);
             continue;
         }
 
-        // Will return length of string, or less than 0 if an error occurs
-        if (ioctl(filedesc, EVIOCGNAME(sizeof(name)), &name) < 0)
+        char namePath[512];
+        snprintf(namePath, sizeof(namePath), "%s/%s/%s", classDir, entry->d_name, nameFile);
+        FILE *file = fopen(namePath, "r");
+        if (!file)
         {
-            printf("Failed to read name of input device %s\n", file_path);
             continue;
         }
-
-        printf("Device %s found\n", name);
-        if (strcmp(name, SENSEHAT_JS_NAME) != 0)
+        char deviceName[256];
+        bool const hasName = fgets(deviceName, sizeof(deviceName), file) != NULL;
+        fclose(file);
+        if (!hasName)
         {
             continue;
         }
 
-        sensehat_joystick.filedesc = filedesc;
-        printf("Found sensehat joystick!\n");
-        break;
+        deviceName[strcspn(deviceName, "\n")] = '\0';
+        if (strcmp(deviceName, name) == 0)
+        {
+            snprintf(path, size, "%s/%s", devDir, entry->d_name);
+            found = true;
+        }
     }
 
     closedir(dir);
-    return sensehat_joystick.filedesc != 0;
+    return found;
 }
 
-bool initializeSenseHatLED()
+// Finds and initializes the sensehat joystick if it is present on the system
+bool initializeSenseHatJoystick()
 {
-    // Local variables here so that we don't change the global state
-    // until we are certain we have the right framebuffer
-    struct fb_fix_screeninfo fixed_info;
-    struct fb_var_screeninfo var_info;
-
-    DIR *dir;
-    struct dirent *entry;
-
-    dir = opendir("/dev");
+    char foundPath[300];
+    char const *path = sensehat_joystick.devicePath;
+    if (!path)
+    {
+        if (!findDeviceByName("/sys/class/input", "event", "device/name", "/dev/input",
+                              SENSEHAT_JS_NAME, foundPath, sizeof(foundPath)))
+        {
+            printf("No input device named %s\n", SENSEHAT_JS_NAME);
+            return false;
+        }
+        path = foundPath;
+    }
 
-    // Unable to open directory
-    if (!dir)
+    printf("Opening joystick %s\n", path);
+    int filedesc = open(path, O_RDONLY | O_NONBLOCK); // Only need read access here
+    if (filedesc == -1)
     {
+        printf("Error occurred while opening file descriptor %s\n", path);
         return false;
     }
 
-    printf("Scanning /dev for sensehat...\n");
-    while ((entry = readdir(dir)) != NULL)
+    // Ask for event timestamps on the monotonic clock, so they can be
+    // compared with clock_gettime() without wall clock jumps
+    int clock = CLOCK_MONOTONIC;
+    sensehat_joystick.clock = ioctl(filedesc, EVIOCSCLOCKID, &clock) == 0 ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+
+    sensehat_joystick.filedesc = filedesc;
+    printf("Found sensehat joystick!\n");
+    return true;
+}
+
+bool initializeSenseHatLED()
+{
+    char foundPath[300];
+    char const *path = sensehat_ctl.devicePath;
+    if (!path)
     {
-        // Check if directory entry name starts with fb
-        if (strncmp(entry->d_name, "fb", 2))
+        // The sysfs name of a framebuffer is the id of its fixed screen info
+        if (!findDeviceByName("/sys/class/graphics", "fb", "name", "/dev",
+                              SENSEHAT_FB_NAME, foundPath, sizeof(foundPath)))
         {
-            continue;
+            printf("No framebuffer named %s\n", SENSEHAT_FB_NAME);
+            return false;
         }
+        path = foundPath;
+    }
 
-        printf("Found framebuffer %s!\n", entry->d_name);
-
-        char file_path[8];
-        strcpy(file_path, "/dev/");
-        strcat(file_path, (char *)&entry->d_name);
+    printf("Opening framebuffer %s\n", path);
+    int filedesc = open(path, O_RDWR);
+    if (filedesc == -1)
+    {
+        printf("Error occurred while opening file descriptor %s\n", path);
+        return false;
+    }
 
-        printf("Opening file descriptor of %s\n", file_path);
-        int filedesc = open(file_path, O_RDWR);
-        if (filedesc == -1)
-        {
-            printf("Error occurred while opening file descriptor %s\n", file_path);
-            continue;
-        }
+    // Local variables here so that we don't change the global state
+    // until we are certain we have the right framebuffer
+    struct fb_fix_screeninfo fixed_info;
+    struct fb_var_screeninfo var_info;
+    if (ioctl(filedesc, FBIOGET_FSCREENINFO, &fixed_info) != 0)
+    {
+        printf("Unable to load fixed screen info!\n");
+        close(filedesc);
+        return false;
+    }
+    if (ioctl(filedesc, FBIOGET_VSCREENINFO, &var_info) != 0)
+    {
+        printf("Unable to load variable screen info!\n");
+        close(filedesc);
+        return false;
+    }
+    printf("ID is %s!\n", fixed_info.id);
 
-        // Attempted to retrieve fixed screen info
-        if (ioctl(filedesc, FBIOGET_FSCREENINFO, &fixed_info) != 0)
-        {
-            // If an error occurs, will not return 0
-            printf("Unable to load fixed screen info!\n");
-            continue;
-        }
+    // We know that the amount of bits will be 16, but this wont hurt anything
+    long screen_bytes = var_info.xres * var_info.yres * (var_info.bits_per_pixel >> 3);
+    sensehat_ctl.screen_bytes = screen_bytes;
+    if (!setupFrame(var_info.xres, var_info.yres, var_info.xres, var_info.xoffset, var_info.yoffset))
+    {
+        close(filedesc);
+        return false;
+    }
 
-        printf("ID is %s!\n", fixed_info.id);
-        if (strcmp(fixed_info.id, SENSEHAT_FB_NAME) != 0)
-        {
-            continue;
-        }
+    u_int16_t *sh_mem = (u_int16_t *)mmap(0, screen_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, filedesc, 0);
+    if (sh_mem == MAP_FAILED)
+    {
+        printf("An error occurred while mapping framebuffer to memory\n");
+        free(sensehat_ctl.frame);
+        close(filedesc);
+        return false;
+    }
 
-        printf("Found sensehat at %s\n", file_path);
-        if (ioctl(filedesc, FBIOGET_VSCREENINFO, &var_info) != 0)
-        {
-            printf("Unable to load variable screen info!\n");
-            return false;
-        }
+    // Update variables so that they are accessible elsewhere
+    sensehat_ctl.filedesc = filedesc;
+    sensehat_ctl.pixels = sh_mem;
+    sensehat_ctl.fix_info = fixed_info;
+    sensehat_ctl.var_info = var_info;
 
-        // We know that the amount of bits will be 16, but this wont hurt anything
-        long screen_bytes = var_info.xres * var_info.yres * (var_info.bits_per_pixel >> 3);
+    // Start with a fresh "screen"
+    clearPixels();
 
-        u_int16_t *sh_mem = (u_int16_t *)mmap(0, screen_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, filedesc, 0);
-        if (sh_mem == -1)
-        {
-            printf("An error occurred while mapping framebuffer to memory");
-            return false;
-        }
+    printf("Successfully loaded sensehat display!\n");
+    return true;
+}
 
-        if (game.grid.x > var_info.xres || game.grid.y > var_info.yres)
-        {
-            printf("Grid is too large for sensehat display! Grid is %u by %u, only support for %u by %u ",
-                   game.grid.x, game.grid.y, var_info.xres, var_info.yres);
-            return false;
-        }
+// Sets up a virtual framebuffer in place of the LED matrix. The pixels are
+// RGB565 lines of width pixels, like the Sense HAT framebuffer.
+static bool initializeVirtualFramebuffer()
+{
+    if (virtual_fb.width == 0 || virtual_fb.height == 0)
+    {
+        printf("Virtual framebuffer needs a size\n");
+        return false;
+    }
 
-        // Update variables so that they are accessible elsewhere
-        sensehat_ctl.filedesc = filedesc;
-        sensehat_ctl.pixels = sh_mem;
-        sensehat_ctl.fix_info = fixed_info;
-        sensehat_ctl.var_info = var_info;
-        sensehat_ctl.screen_bytes = screen_bytes;
+    int const filedesc = virtual_fb.path ? open(virtual_fb.path, O_RDWR | O_CREAT, 0644)
+                                         : memfd_create("stetris-fb", MFD_CLOEXEC);
+    if (filedesc == -1)
+    {
+        printf("Unable to create virtual framebuffer %s\n", virtual_fb.path ? virtual_fb.path : "in memory");
+        return false;
+    }
 
-        // Start with a fresh "screen"
-        clearPixels();
+    sensehat_ctl.screen_bytes = virtual_fb.width * virtual_fb.height * sizeof(u_int16_t);
+    if (ftruncate(filedesc, sensehat_ctl.screen_bytes) != 0 ||
+        !setupFrame(virtual_fb.width, virtual_fb.height, virtual_fb.width, 0, 0))
+    {
+        close(filedesc);
+        return false;
+    }
 
-        printf("Successfully loaded sensehat display!\n");
-        break;
+    u_int16_t *memory = (u_int16_t *)mmap(0, sensehat_ctl.screen_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, filedesc, 0);
+    if (memory == MAP_FAILED)
+    {
+        printf("An error occurred while mapping the virtual framebuffer\n");
+        free(sensehat_ctl.frame);
+        close(filedesc);
+        return false;
     }
 
-    closedir(dir);
-    return sensehat_ctl.pixels != 0;
+    sensehat_ctl.filedesc = filedesc;
+    sensehat_ctl.pixels = memory;
+    clearPixels();
+
+    printf("Virtual framebuffer of %u by %u pixels, %u pixels per tile\n",
+           virtual_fb.width, virtual_fb.height, sensehat_ctl.scale);
+    return true;
 }
 
 // This function is called on the start of your application
@@ -264,6 +565,12 @@ bool initializeSenseHatLED()
 // return false if something fails, else true
 bool initializeSenseHat()
 {
+    // With a virtual framebuffer the joystick is optional
+    if (virtual_fb.enabled)
+    {
+        return initializeVirtualFramebuffer() &&
+               (!sensehat_joystick.devicePath || initializeSenseHatJoystick());
+    }
     return initializeSenseHatLED() && initializeSenseHatJoystick();
 }
 
@@ -273,8 +580,10 @@ void freeSenseHat()
 {
     clearPixels();
     munmap(sensehat_ctl.pixels, sensehat_ctl.screen_bytes);
+    free(sensehat_ctl.frame);
     close(sensehat_ctl.filedesc);
-    close(sensehat_joystick.filedesc);
+    if (sensehat_joystick.filedesc != -1)
+        close(sensehat_joystick.filedesc);
 }
 
 // This function should return the key that corresponds to the joystick press
@@ -284,7 +593,7 @@ void freeSenseHat()
 int readSenseHatJoystick()
 {
     // Shouldn't happen, but make sure here aswell
-    if (sensehat_joystick.filedesc == 0)
+    if (sensehat_joystick.filedesc == -1)
     {
         return 0;
     }
@@ -313,6 +622,8 @@ int readSenseHatJoystick()
         // We can return directly here because they joystick physically does not allow
         // more than one button to be pressed at once. event.code corresponds correctly
         // to our key mappings due to the rotation of our screen/LED matrix.
+        sensehat_joystick.eventTime.tv_sec = event.time.tv_sec;
+        sensehat_joystick.eventTime.tv_nsec = event.time.tv_usec * 1000;
         return event.code;
     }
 
@@ -331,74 +642,225 @@ void renderSenseHatMatrix(bool const playfieldChanged)
         return;
     }
 
-    for (u_int32_t x = 0; x < game.grid.x; x++)
+    // Only draw the tiles that changed since the last frame
+    unsigned int const scale = sensehat_ctl.scale;
+    unsigned int const stride = sensehat_ctl.stride;
+    for (unsigned int i = 0; i < dirty_tiles.count; i++)
+    {
+        coord const target = dirty_tiles.tiles[i];
+        // Here abusing the fact that color will be 0 (i. e. off) for any unoccupied
+        // tile. This avoids a clearPixels() call and an if-statement within the loop
+        u_int16_t const color = game.colors[target.y * game.grid.x + target.x];
+        unsigned int const top = sensehat_ctl.originY + target.y * scale;
+        u_int16_t *line = &sensehat_ctl.frame[(size_t)top * stride + sensehat_ctl.originX + target.x * scale];
+        for (unsigned int y = 0; y < scale; y++, line += stride)
+        {
+            for (unsigned int x = 0; x < scale; x++)
+            {
+                line[x] = color;
+            }
+        }
+
+        if (sensehat_ctl.changedTop > sensehat_ctl.changedBottom)
+        {
+            sensehat_ctl.changedTop = top;
+            sensehat_ctl.changedBottom = top + scale - 1;
+        }
+        else
+        {
+            if (top < sensehat_ctl.changedTop)
+                sensehat_ctl.changedTop = top;
+            if (top + scale - 1 > sensehat_ctl.changedBottom)
+                sensehat_ctl.changedBottom = top + scale - 1;
+        }
+    }
+
+    presentFrame();
+}
+
+static unsigned int latencyBucket(u_int64_t const uSec)
+{
+    if (uSec < LATENCY_SUB_BUCKETS)
+        return uSec;
+    unsigned int const exponent = 63 - __builtin_clzll(uSec);
+    unsigned int const bucket = (exponent - 3) * LATENCY_SUB_BUCKETS + ((uSec >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Largest latency that falls in the bucket
+static u_int64_t latencyBucketLimit(unsigned int const bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    unsigned int const exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    u_int64_t const low = (u_int64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (exponent - 4);
+    return low + ((u_int64_t)1 << (exponent - 4)) - 1;
+}
+
+// Records the latency of a press whose result has just been written to
+// the LED matrix
+static void recordInputLatency(struct timespec const eventTime)
+{
+    struct timespec now;
+    clock_gettime(sensehat_joystick.clock, &now);
+    long long const nSec = (now.tv_sec - eventTime.tv_sec) * 1000000000LL + (now.tv_nsec - eventTime.tv_nsec);
+    u_int64_t const uSec = nSec > 0 ? nSec / 1000 : 0;
+
+    input_latency.counts[latencyBucket(uSec)]++;
+    input_latency.samples++;
+    if (uSec > input_latency.max)
+        input_latency.max = uSec;
+}
+
+static u_int64_t latencyPercentileUSec(double const percentile)
+{
+    u_int64_t const rank = (u_int64_t)(percentile / 100.0 * input_latency.samples + 0.999999);
+    u_int64_t seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
     {
-        for (u_int32_t y = 0; y < game.grid.y; y++)
+        seen += input_latency.counts[i];
+        if (seen >= rank && seen > 0)
         {
-            tile current = game.playfield[x][y];
-            // Here abusing the fact that color will be 0 (i. e. off) for any unoccupied
-            // tile. This avoids a clearPixels() call and an if-statement within the loop
-            sensehat_ctl.pixels[getLocation(x, y)] = current.color;
+            u_int64_t const limit = latencyBucketLimit(i);
+            return limit < input_latency.max ? limit : input_latency.max;
         }
     }
+    return input_latency.max;
+}
+
+static void printInputLatency(FILE *const out)
+{
+    fprintf(out, "Input to display latency: %" PRIu64 " presses", input_latency.samples);
+    if (input_latency.samples == 0)
+    {
+        fprintf(out, "\n");
+        return;
+    }
+    fprintf(out, ", p50 %" PRIu64 " us, p99 %" PRIu64 " us, max %" PRIu64 " us\n",
+            latencyPercentileUSec(50), latencyPercentileUSec(99), input_latency.max);
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        if (input_latency.counts[i])
+            fprintf(out, "  <= %8" PRIu64 " us: %" PRIu64 "\n", latencyBucketLimit(i), input_latency.counts[i]);
+    }
+}
+
+static void requestLatencyDump(int signal)
+{
+    (void)signal;
+    latencyDumpRequested = 1;
+}
+
+static void requestQuit(int signal)
+{
+    (void)signal;
+    quitRequested = 1;
+}
+
+static inline void markTileDirty(gameConfig *const board, coord const target)
+{
+    dirty_tiles_t *const dirty = board->dirty;
+    if (!dirty)
+        return;
+    bool *flag = &dirty->flags[target.y * board->grid.x + target.x];
+    if (!*flag)
+    {
+        *flag = true;
+        dirty->tiles[dirty->count++] = target;
+    }
+}
+
+static inline void markRowDirty(gameConfig *const board, unsigned int const target)
+{
+    for (unsigned int x = 0; x < board->grid.x; x++)
+    {
+        coord const dirtyTile = {x, target};
+        markTileDirty(board, dirtyTile);
+    }
+}
+
+// Called once a frame has been rendered to every output
+static inline void clearDirtyTiles()
+{
+    for (unsigned int i = 0; i < dirty_tiles.count; i++)
+    {
+        coord const target = dirty_tiles.tiles[i];
+        dirty_tiles.flags[target.y * game.grid.x + target.x] = false;
+    }
+    dirty_tiles.count = 0;
 }
 
 // The game logic uses only the following functions to interact with the playfield.
 // if you choose to change the playfield or the tile structure, you might need to
 // adjust this game logic <> playfield interface
-static inline void newTile(coord const target)
+static inline void newTile(gameConfig *const board, coord const target)
 {
-    game.playfield[target.y][target.x].occupied = true;
-    game.playfield[target.y][target.x].color = COLORS[game.colorIndex];
+    board->occupied[target.y] |= (row_bits)1 << target.x;
+    board->colors[target.y * board->grid.x + target.x] = COLORS[board->colorIndex];
+    markTileDirty(board, target);
 
     // Increment to next color
-    game.colorIndex++;
-    game.colorIndex %= COLOR_COUNT;
+    board->colorIndex++;
+    board->colorIndex %= COLOR_COUNT;
 }
 
-static inline void copyTile(coord const to, coord const from)
+static inline void copyTile(gameConfig *const board, coord const to, coord const from)
 {
-    memcpy((void *)&game.playfield[to.y][to.x], (void *)&game.playfield[from.y][from.x], sizeof(tile));
+    row_bits const bit = (board->occupied[from.y] >> from.x) & 1;
+    board->occupied[to.y] = (board->occupied[to.y] & ~((row_bits)1 << to.x)) | (bit << to.x);
+    board->colors[to.y * board->grid.x + to.x] = board->colors[from.y * board->grid.x + from.x];
+    markTileDirty(board, to);
 }
 
-static inline void copyRow(unsigned int const to, unsigned int const from)
+static inline void copyRow(gameConfig *const board, unsigned int const to, unsigned int const from)
 {
-    memcpy((void *)&game.playfield[to][0], (void *)&game.playfield[from][0], sizeof(tile) * game.grid.x);
+    board->occupied[to] = board->occupied[from];
+    memcpy((void *)&board->colors[to * board->grid.x], (void *)&board->colors[from * board->grid.x], sizeof(u_int16_t) * board->grid.x);
+    markRowDirty(board, to);
 }
 
-static inline void resetTile(coord const target)
+static inline void resetTile(gameConfig *const board, coord const target)
 {
-    memset((void *)&game.playfield[target.y][target.x], 0, sizeof(tile));
+    board->occupied[target.y] &= ~((row_bits)1 << target.x);
+    board->colors[target.y * board->grid.x + target.x] = 0;
+    markTileDirty(board, target);
 }
 
-static inline void resetRow(unsigned int const target)
+static inline void resetRow(gameConfig *const board, unsigned int const target)
 {
-    memset((void *)&game.playfield[target][0], 0, sizeof(tile) * game.grid.x);
+    board->occupied[target] = 0;
+    memset((void *)&board->colors[target * board->grid.x], 0, sizeof(u_int16_t) * board->grid.x);
+    markRowDirty(board, target);
 }
 
-static inline bool tileOccupied(coord const target)
+// Removes the given row by shifting every row above it one step down, and
+// then empties the top row
+static inline void dropRow(gameConfig *const board, unsigned int const target)
 {
-    return game.playfield[target.y][target.x].occupied;
+    memmove((void *)&board->occupied[1], (void *)&board->occupied[0], sizeof(row_bits) * target);
+    memmove((void *)&board->colors[board->grid.x], (void *)&board->colors[0], sizeof(u_int16_t) * board->grid.x * target);
+    for (unsigned int y = 1; y <= target; y++)
+    {
+        markRowDirty(board, y);
+    }
+    resetRow(board, 0);
 }
 
-static inline bool rowOccupied(unsigned int const target)
+static inline bool tileOccupied(gameConfig *const board, coord const target)
 {
-    for (unsigned int x = 0; x < game.grid.x; x++)
-    {
-        coord const checkTile = {x, target};
-        if (!tileOccupied(checkTile))
-        {
-            return false;
-        }
-    }
-    return true;
+    return (board->occupied[target.y] >> target.x) & 1;
 }
 
-static inline void resetPlayfield()
+static inline bool rowOccupied(gameConfig *const board, unsigned int const target)
 {
-    for (unsigned int y = 0; y < game.grid.y; y++)
+    return board->occupied[target] == board->fullRow;
+}
+
+static inline void resetPlayfield(gameConfig *const board)
+{
+    for (unsigned int y = 0; y < board->grid.y; y++)
     {
-        resetRow(y);
+        resetRow(board, y);
     }
 }
 
@@ -406,109 +868,110 @@ static inline void resetPlayfield()
 // that means no changes are necessary below this line! And if you choose to change something
 // keep it compatible with what was provided to you!
 
-bool addNewTile()
+bool addNewTile(gameConfig *const board)
 {
-    game.activeTile.y = 0;
-    game.activeTile.x = (game.grid.x - 1) / 2;
-    if (tileOccupied(game.activeTile))
+    board->activeTile.y = 0;
+    board->activeTile.x = (board->grid.x - 1) / 2;
+    if (tileOccupied(board, board->activeTile))
         return false;
-    newTile(game.activeTile);
+    newTile(board, board->activeTile);
     return true;
 }
 
-bool moveRight()
+bool moveRight(gameConfig *const board)
 {
-    coord const newTile = {game.activeTile.x + 1, game.activeTile.y};
-    if (game.activeTile.x < (game.grid.x - 1) && !tileOccupied(newTile))
+    coord const newTile = {board->activeTile.x + 1, board->activeTile.y};
+    if (board->activeTile.x < (board->grid.x - 1) && !tileOccupied(board, newTile))
     {
-        copyTile(newTile, game.activeTile);
-        resetTile(game.activeTile);
-        game.activeTile = newTile;
+        copyTile(board, newTile, board->activeTile);
+        resetTile(board, board->activeTile);
+        board->activeTile = newTile;
         return true;
     }
     return false;
 }
 
-bool moveLeft()
+bool moveLeft(gameConfig *const board)
 {
-    coord const newTile = {game.activeTile.x - 1, game.activeTile.y};
-    if (game.activeTile.x > 0 && !tileOccupied(newTile))
+    coord const newTile = {board->activeTile.x - 1, board->activeTile.y};
+    if (board->activeTile.x > 0 && !tileOccupied(board, newTile))
     {
-        copyTile(newTile, game.activeTile);
-        resetTile(game.activeTile);
-        game.activeTile = newTile;
+        copyTile(board, newTile, board->activeTile);
+        resetTile(board, board->activeTile);
+        board->activeTile = newTile;
         return true;
     }
     return false;
 }
 
-bool moveDown()
+bool moveDown(gameConfig *const board)
 {
-    coord const newTile = {game.activeTile.x, game.activeTile.y + 1};
-    if (game.activeTile.y < (game.grid.y - 1) && !tileOccupied(newTile))
+    coord const newTile = {board->activeTile.x, board->activeTile.y + 1};
+    if (board->activeTile.y < (board->grid.y - 1) && !tileOccupied(board, newTile))
     {
-        copyTile(newTile, game.activeTile);
-        resetTile(game.activeTile);
-        game.activeTile = newTile;
+        copyTile(board, newTile, board->activeTile);
+        resetTile(board, board->activeTile);
+        board->activeTile = newTile;
         return true;
     }
     return false;
 }
 
-bool clearRow()
+bool clearRow(gameConfig *const board)
 {
-    if (rowOccupied(game.grid.y - 1))
+    if (rowOccupied(board, board->grid.y - 1))
     {
-        for (unsigned int y = game.grid.y - 1; y > 0; y--)
-        {
-            copyRow(y, y - 1);
-        }
-        resetRow(0);
+        dropRow(board, board->grid.y - 1);
         return true;
     }
     return false;
 }
 
-void advanceLevel()
+// The tick count of the next level. Shared with the batch boards.
+static inline unsigned long fasterGameTick(unsigned long const nextGameTick)
 {
-    game.level++;
-    switch (game.nextGameTick)
+    switch (nextGameTick)
     {
     case 1:
-        break;
+        return 1;
     case 2 ... 10:
-        game.nextGameTick--;
-        break;
+        return nextGameTick - 1;
     case 11 ... 20:
-        game.nextGameTick -= 2;
-        break;
+        return nextGameTick - 2;
     default:
-        game.nextGameTick -= 10;
+        return nextGameTick - 10;
     }
 }
 
-void newGame()
+void advanceLevel(gameConfig *const board)
+{
+    board->level++;
+    board->nextGameTick = fasterGameTick(board->nextGameTick);
+}
+
+void newGame(gameConfig *const board)
 {
-    game.state = ACTIVE;
-    game.tiles = 0;
-    game.rows = 0;
-    game.score = 0;
-    game.tick = 0;
-    game.level = 0;
-    resetPlayfield();
+    board->state = ACTIVE;
+    board->games++;
+    board->tiles = 0;
+    board->rows = 0;
+    board->score = 0;
+    board->tick = 0;
+    board->level = 0;
+    resetPlayfield(board);
 }
 
-void gameOver()
+void gameOver(gameConfig *const board)
 {
-    game.state = GAMEOVER;
-    game.nextGameTick = game.initNextGameTick;
+    board->state = GAMEOVER;
+    board->nextGameTick = board->initNextGameTick;
 }
 
-bool sTetris(int const key)
+bool sTetris(gameConfig *const board, int const key)
 {
     bool playfieldChanged = false;
 
-    if (game.state & ACTIVE)
+    if (board->state & ACTIVE)
     {
         // Move the current tile
         if (key)
@@ -517,16 +980,16 @@ bool sTetris(int const key)
             switch (key)
             {
             case KEY_LEFT:
-                moveLeft();
+                moveLeft(board);
                 break;
             case KEY_RIGHT:
-                moveRight();
+                moveRight(board);
                 break;
             case KEY_DOWN:
-                while (moveDown())
+                while (moveDown(board))
                 {
                 };
-                game.tick = 0;
+                board->tick = 0;
                 break;
             default:
                 playfieldChanged = false;
@@ -534,74 +997,58 @@ bool sTetris(int const key)
         }
 
         // If we have reached a tick to update the game
-        if (game.tick == 0)
+        if (board->tick == 0)
         {
             // We communicate the row clear and tile add over the game state
             // clear these bits if they were set before
-            game.state &= ~(ROW_CLEAR | TILE_ADDED);
+            board->state &= ~(ROW_CLEAR | TILE_ADDED);
 
             playfieldChanged = true;
             // Clear row if possible
-            if (clearRow())
+            if (clearRow(board))
             {
-                game.state |= ROW_CLEAR;
-                game.rows++;
-                game.score += game.level + 1;
-                if ((game.rows % game.rowsPerLevel) == 0)
+                board->state |= ROW_CLEAR;
+                board->rows++;
+                board->score += board->level + 1;
+                if ((board->rows % board->rowsPerLevel) == 0)
                 {
-                    advanceLevel();
+                    advanceLevel(board);
                 }
             }
 
             // if there is no current tile or we cannot move it down,
             // add a new one. If not possible, game over.
-            if (!tileOccupied(game.activeTile) || !moveDown())
+            if (!tileOccupied(board, board->activeTile) || !moveDown(board))
             {
-                if (addNewTile())
+                if (addNewTile(board))
                 {
-                    game.state |= TILE_ADDED;
-                    game.tiles++;
+                    board->state |= TILE_ADDED;
+                    board->tiles++;
                 }
                 else
                 {
-                    gameOver();
+                    gameOver(board);
                 }
             }
         }
     }
 
     // Press any key to start a new game
-    if ((game.state == GAMEOVER) && key)
+    if ((board->state == GAMEOVER) && key)
     {
         playfieldChanged = true;
-        newGame();
-        addNewTile();
-        game.state |= TILE_ADDED;
-        game.tiles++;
+        newGame(board);
+        addNewTile(board);
+        board->state |= TILE_ADDED;
+        board->tiles++;
     }
 
     return playfieldChanged;
 }
 
-int readKeyboard()
+static int keyFromByte(int const byte)
 {
-    struct pollfd pollStdin = {
-        .fd = STDIN_FILENO,
-        .events = POLLIN};
-    int lkey = 0;
-
-    if (poll(&pollStdin, 1, 0))
-    {
-        lkey = fgetc(stdin);
-        if (lkey != 27)
-            goto exit;
-        lkey = fgetc(stdin);
-        if (lkey != 91)
-            goto exit;
-        lkey = fgetc(stdin);
-    }
-exit:
-    switch (lkey)
+    switch (byte)
     {
     case 10:
         return KEY_ENTER;
@@ -617,131 +1064,1668 @@ exit:
     return 0;
 }
 
-void renderConsole(bool const playfieldChanged)
+// Returns the next key from the bytes available on stdin, or 0 once they
+// are used up. An escape sequence split across reads is finished on a later
+// call, so this never waits for the rest of it. Sets keyboard_ctl.closed
+// once stdin is at its end.
+int readKeyboard()
 {
-    if (!playfieldChanged)
-        return;
+    struct pollfd pollStdin = {
+        .fd = STDIN_FILENO,
+        .events = POLLIN};
 
-    // Goto beginning of console
-    fprintf(stdout, "\033[%d;%dH", 0, 0);
-    for (unsigned int x = 0; x < game.grid.x + 2; x++)
-    {
-        fprintf(stdout, "-");
-    }
-    fprintf(stdout, "\n");
-    for (unsigned int y = 0; y < game.grid.y; y++)
+    while (true)
     {
-        fprintf(stdout, "|");
-        for (unsigned int x = 0; x < game.grid.x; x++)
+        if (keyboard_ctl.offset == keyboard_ctl.length)
+        {
+            if (poll(&pollStdin, 1, 0) <= 0)
+                return 0;
+            keyboard_ctl.length = read(STDIN_FILENO, keyboard_ctl.buffer, sizeof(keyboard_ctl.buffer));
+            keyboard_ctl.offset = 0;
+            if (keyboard_ctl.length <= 0)
+            {
+                keyboard_ctl.closed = keyboard_ctl.length == 0 || (errno != EINTR && errno != EAGAIN);
+                keyboard_ctl.length = 0;
+                return 0;
+            }
+        }
+
+        int const byte = keyboard_ctl.buffer[keyboard_ctl.offset++];
+        if (keyboard_ctl.escape == 2)
         {
-            coord const checkTile = {x, y};
-            fprintf(stdout, "%c", (tileOccupied(checkTile)) ? '#' : ' ');
+            keyboard_ctl.escape = 0;
+            return keyFromByte(byte);
         }
-        switch (y)
+        if (keyboard_ctl.escape == 1 && byte == 91)
         {
-        case 0:
-            fprintf(stdout, "| Tiles: %10u\n", game.tiles);
-            break;
-        case 1:
-            fprintf(stdout, "| Rows:  %10u\n", game.rows);
-            break;
-        case 2:
-            fprintf(stdout, "| Score: %10u\n", game.score);
-            break;
-        case 4:
-            fprintf(stdout, "| Level: %10u\n", game.level);
-            break;
-        case 7:
-            fprintf(stdout, "| %17s\n", (game.state == GAMEOVER) ? "Game Over" : "");
-            break;
-        default:
-            fprintf(stdout, "|\n");
+            keyboard_ctl.escape = 2;
+            continue;
         }
+        keyboard_ctl.escape = byte == 27;
+        int const key = keyFromByte(byte);
+        if (key)
+            return key;
     }
-    for (unsigned int x = 0; x < game.grid.x + 2; x++)
-    {
-        fprintf(stdout, "-");
-    }
-    fflush(stdout);
 }
 
-inline unsigned long uSecFromTimespec(struct timespec const ts)
+// Appends formatted output to the console buffer, growing it if needed
+static void appendConsole(char const *format, ...)
+{
+    while (true)
+    {
+        va_list args;
+        va_start(args, format);
+        int const written = vsnprintf(console_ctl.buffer + console_ctl.length, console_ctl.size - console_ctl.length, format, args);
+        va_end(args);
+
+        if (written < 0)
+            return;
+        if ((size_t)written < console_ctl.size - console_ctl.length)
+        {
+            console_ctl.length += written;
+            return;
+        }
+
+        console_ctl.size = console_ctl.size * 2 + written;
+        console_ctl.buffer = realloc(console_ctl.buffer, console_ctl.size);
+    }
+}
+
+// Appends a cursor movement to the given playfield row and column. The
+// border takes up the first row and column of the console.
+static inline void appendCursor(unsigned int const row, unsigned int const column)
+{
+    appendConsole("\033[%u;%uH", row + 2, column + 2);
+}
+
+// Appends the stats shown next to the given playfield row, if any
+static void appendStats(unsigned int const y)
+{
+    switch (y)
+    {
+    case 0:
+        appendConsole("| Tiles: %10u", game.tiles);
+        break;
+    case 1:
+        appendConsole("| Rows:  %10u", game.rows);
+        break;
+    case 2:
+        appendConsole("| Score: %10u", game.score);
+        break;
+    case 4:
+        appendConsole("| Level: %10u", game.level);
+        break;
+    case 7:
+        appendConsole("| %17s", (game.state == GAMEOVER) ? "Game Over" : "");
+        break;
+    default:
+        appendConsole("|");
+    }
+}
+
+// Redraws the stats next to the given row if the value has changed
+static void updateStats(unsigned int const y, unsigned int *const shown, unsigned int const value)
+{
+    if (*shown == value || y >= game.grid.y)
+        return;
+    *shown = value;
+    appendCursor(y, game.grid.x);
+    appendStats(y);
+}
+
+void renderConsole(bool const playfieldChanged)
+{
+    if (!playfieldChanged)
+        return;
+
+    console_ctl.length = 0;
+
+    if (!console_ctl.drawn)
+    {
+        // Draw the whole frame the first time, the same way as it has
+        // always looked
+        appendConsole("\033[%d;%dH", 0, 0);
+        for (unsigned int x = 0; x < game.grid.x + 2; x++)
+        {
+            appendConsole("-");
+        }
+        appendConsole("\n");
+        for (unsigned int y = 0; y < game.grid.y; y++)
+        {
+            appendConsole("|");
+            for (unsigned int x = 0; x < game.grid.x; x++)
+            {
+                coord const checkTile = {x, y};
+                appendConsole("%c", (tileOccupied(&game, checkTile)) ? '#' : ' ');
+            }
+            appendStats(y);
+            appendConsole("\n");
+        }
+        for (unsigned int x = 0; x < game.grid.x + 2; x++)
+        {
+            appendConsole("-");
+        }
+
+        console_ctl.drawn = true;
+        console_ctl.tiles = game.tiles;
+        console_ctl.rows = game.rows;
+        console_ctl.score = game.score;
+        console_ctl.level = game.level;
+        console_ctl.gameOver = game.state == GAMEOVER;
+    }
+    else
+    {
+        for (unsigned int i = 0; i < dirty_tiles.count; i++)
+        {
+            coord const target = dirty_tiles.tiles[i];
+            appendCursor(target.y, target.x);
+            appendConsole("%c", (tileOccupied(&game, target)) ? '#' : ' ');
+        }
+
+        updateStats(0, &console_ctl.tiles, game.tiles);
+        updateStats(1, &console_ctl.rows, game.rows);
+        updateStats(2, &console_ctl.score, game.score);
+        updateStats(4, &console_ctl.level, game.level);
+
+        bool const gameOver = game.state == GAMEOVER;
+        if (gameOver != console_ctl.gameOver && game.grid.y > 7)
+        {
+            console_ctl.gameOver = gameOver;
+            appendCursor(7, game.grid.x);
+            appendStats(7);
+        }
+
+        // Leave the cursor after the bottom border, like a full redraw does
+        appendCursor(game.grid.y, game.grid.x + 1);
+    }
+
+    // Write the whole frame at once
+    size_t offset = 0;
+    while (offset < console_ctl.length)
+    {
+        ssize_t const written = write(STDOUT_FILENO, console_ctl.buffer + offset, console_ctl.length - offset);
+        if (written <= 0)
+        {
+            if (written == -1 && errno == EINTR)
+                continue;
+            break;
+        }
+        offset += written;
+    }
+}
+
+inline unsigned long uSecFromTimespec(struct timespec const ts)
 {
     return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
 }
 
-int main(int argc, char **argv)
+static inline struct timespec timespecAddUSec(struct timespec ts, unsigned long const uSec)
+{
+    ts.tv_sec += uSec / 1000000;
+    ts.tv_nsec += (uSec % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Arms the timer to expire once at the given absolute CLOCK_MONOTONIC time.
+// Using absolute deadlines keeps the ticks from drifting, and re-arming
+// resets any expiration that has not been read yet.
+static bool armTickTimer(int const timerfd, struct timespec const deadline)
+{
+    struct itimerspec spec = {
+        .it_value = deadline,
+    };
+    return timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+static bool addEpollFd(int const epollfd, int const fd)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// Called by the input thread only. Returns false if the queue is full.
+static bool pushKeyEvent(key_event_t const *const event)
+{
+    size_t const head = atomic_load_explicit(&key_queue.head, memory_order_relaxed);
+    size_t const tail = atomic_load_explicit(&key_queue.tail, memory_order_acquire);
+    if (head - tail == KEY_QUEUE_SIZE)
+        return false;
+    key_queue.events[head & (KEY_QUEUE_SIZE - 1)] = *event;
+    atomic_store_explicit(&key_queue.head, head + 1, memory_order_release);
+    return true;
+}
+
+// Called by the game only. Returns false if the queue is empty.
+static bool popKeyEvent(key_event_t *const event)
+{
+    size_t const tail = atomic_load_explicit(&key_queue.tail, memory_order_relaxed);
+    size_t const head = atomic_load_explicit(&key_queue.head, memory_order_acquire);
+    if (head == tail)
+        return false;
+    *event = key_queue.events[tail & (KEY_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&key_queue.tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Queues a press and wakes up the game. If the game falls behind by a full
+// queue, wait for it rather than drop the press.
+static void queueKey(int const key, input_source_t const source, struct timespec const time)
+{
+    key_event_t const event = {.key = key, .source = source, .time = time};
+    uint64_t const one = 1;
+    while (!pushKeyEvent(&event))
+    {
+        if (atomic_load_explicit(&input_thread.stop, memory_order_relaxed))
+            return;
+        write(input_thread.wakefd, &one, sizeof(one));
+        struct timespec const pause = {.tv_nsec = 100000};
+        nanosleep(&pause, NULL);
+    }
+    write(input_thread.wakefd, &one, sizeof(one));
+}
+
+// Input thread: blocks on the joystick and the keyboard and queues every
+// press, so that the game thread never waits on input
+static void *readInput(void *unused)
+{
+    (void)unused;
+    int const epollfd = epoll_create1(0);
+    // epoll can't watch stdin if it is a regular file or /dev/null, which
+    // just leaves the joystick
+    bool const keyboard = epollfd != -1 && (addEpollFd(epollfd, STDIN_FILENO) || errno == EPERM);
+    if (epollfd == -1 || !keyboard ||
+        (sensehat_joystick.filedesc != -1 && !addEpollFd(epollfd, sensehat_joystick.filedesc)) ||
+        !addEpollFd(epollfd, input_thread.stopfd))
+    {
+        fprintf(stderr, "ERROR: could not set up input thread\n");
+        if (epollfd != -1)
+            close(epollfd);
+        // Quitting is the only sensible thing without input
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        queueKey(KEY_ENTER, INPUT_KEYBOARD, now);
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&input_thread.stop, memory_order_relaxed))
+    {
+        struct epoll_event events[3];
+        int const count = epoll_wait(epollfd, events, 3, -1);
+        for (int i = 0; i < count; i++)
+        {
+            int const fd = events[i].data.fd;
+            int key;
+            if (fd == sensehat_joystick.filedesc)
+            {
+                while ((key = readSenseHatJoystick()))
+                    queueKey(key, INPUT_JOYSTICK, sensehat_joystick.eventTime);
+            }
+            else if (fd == STDIN_FILENO)
+            {
+                while ((key = readKeyboard()))
+                {
+                    struct timespec now;
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    queueKey(key, INPUT_KEYBOARD, now);
+                }
+                // A closed stdin stays readable, so stop watching it
+                if (keyboard_ctl.closed || (events[i].events & (EPOLLHUP | EPOLLERR)))
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            }
+        }
+    }
+
+    close(epollfd);
+    return NULL;
+}
+
+// Starts the input thread with signals blocked, so they are handled by the
+// game thread
+static bool startInputThread()
+{
+    input_thread.wakefd = eventfd(0, EFD_NONBLOCK);
+    input_thread.stopfd = eventfd(0, EFD_NONBLOCK);
+    if (input_thread.wakefd == -1 || input_thread.stopfd == -1)
+        return false;
+
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    bool const started = pthread_create(&input_thread.thread, NULL, readInput, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return started;
+}
+
+static void stopInputThread()
+{
+    uint64_t const one = 1;
+    atomic_store(&input_thread.stop, true);
+    write(input_thread.stopfd, &one, sizeof(one));
+    pthread_join(input_thread.thread, NULL);
+    close(input_thread.wakefd);
+    close(input_thread.stopfd);
+}
+
+// Allocates the playfield and the render state for the configured grid
+static bool allocatePlayfield()
+{
+    if (game.grid.x == 0 || game.grid.x > MAX_GRID_WIDTH || game.grid.y == 0)
+    {
+        fprintf(stderr, "ERROR: grid width must be between 1 and %lu, and height at least 1\n", MAX_GRID_WIDTH);
+        return false;
+    }
+    game.occupied = (row_bits *)malloc(game.grid.y * sizeof(row_bits));
+    game.colors = (u_int16_t *)malloc(game.grid.x * game.grid.y * sizeof(u_int16_t));
+    if (!game.occupied || !game.colors)
+    {
+        fprintf(stderr, "ERROR: could not allocate playfield\n");
+        return false;
+    }
+    game.fullRow = (game.grid.x == MAX_GRID_WIDTH) ? ~(row_bits)0 : ((row_bits)1 << game.grid.x) - 1;
+
+    // Allocate the change tracking and the console output buffer. The
+    // buffer grows on demand, but this fits a full frame.
+    dirty_tiles.flags = (bool *)calloc(game.grid.x * game.grid.y, sizeof(bool));
+    dirty_tiles.tiles = (coord *)malloc(game.grid.x * game.grid.y * sizeof(coord));
+    console_ctl.size = (game.grid.x + 32) * (game.grid.y + 2) + game.grid.x * game.grid.y * 16;
+    console_ctl.buffer = (char *)malloc(console_ctl.size);
+    if (!dirty_tiles.flags || !dirty_tiles.tiles || !console_ctl.buffer)
+    {
+        fprintf(stderr, "ERROR: could not allocate render state\n");
+        return false;
+    }
+    game.dirty = &dirty_tiles;
+    return true;
+}
+
+static void freePlayfield()
+{
+    free(game.occupied);
+    free(game.colors);
+    free(dirty_tiles.flags);
+    free(dirty_tiles.tiles);
+    free(console_ctl.buffer);
+}
+
+// xorshift64*, so a seed plays the same on every libc
+static inline u_int64_t nextRandom(u_int64_t *const state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Reads a key script: one character per tick, where l, r, d and u press
+// left, right, down and up, and . is a tick without input. Whitespace is
+// skipped and # starts a comment that runs to the end of the line.
+static bool loadScript(headless_t *const headless)
+{
+    FILE *file = fopen(headless->scriptPath, "r");
+    if (!file)
+    {
+        fprintf(stderr, "ERROR: could not open script %s\n", headless->scriptPath);
+        return false;
+    }
+
+    size_t capacity = 4096;
+    headless->script = (int *)malloc(capacity * sizeof(int));
+    headless->scriptLength = 0;
+    bool ok = headless->script != NULL;
+    int c;
+    while (ok && (c = fgetc(file)) != EOF)
+    {
+        int key;
+        switch (c)
+        {
+        case 'l':
+        case 'L':
+            key = KEY_LEFT;
+            break;
+        case 'r':
+        case 'R':
+            key = KEY_RIGHT;
+            break;
+        case 'd':
+        case 'D':
+            key = KEY_DOWN;
+            break;
+        case 'u':
+        case 'U':
+            key = KEY_UP;
+            break;
+        case '.':
+            key = 0;
+            break;
+        case '#':
+            while ((c = fgetc(file)) != EOF && c != '\n')
+            {
+            }
+            continue;
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            continue;
+        default:
+            fprintf(stderr, "ERROR: unexpected character '%c' in script %s\n", c, headless->scriptPath);
+            ok = false;
+            continue;
+        }
+
+        if (headless->scriptLength == capacity)
+        {
+            capacity *= 2;
+            int *grown = (int *)realloc(headless->script, capacity * sizeof(int));
+            if (!grown)
+            {
+                ok = false;
+                continue;
+            }
+            headless->script = grown;
+        }
+        headless->script[headless->scriptLength++] = key;
+    }
+    fclose(file);
+
+    if (ok && headless->scriptLength == 0)
+    {
+        fprintf(stderr, "ERROR: script %s contains no ticks\n", headless->scriptPath);
+        ok = false;
+    }
+    return ok;
+}
+
+// Keys of the generated stream. Most ticks have no input, and KEY_ENTER is
+// left out since it would quit the interactive game.
+static inline int randomKey(u_int64_t *const random)
+{
+    switch (nextRandom(random) % 16)
+    {
+    case 0:
+    case 1:
+        return KEY_LEFT;
+    case 2:
+    case 3:
+        return KEY_RIGHT;
+    case 4:
+        return KEY_DOWN;
+    case 5:
+        return KEY_UP;
+    default:
+        return 0;
+    }
+}
+
+static int nextHeadlessKey(headless_t const *const headless, unsigned long const tick, u_int64_t *const random)
+{
+    if (headless->script)
+    {
+        return headless->script[tick % headless->scriptLength];
+    }
+    return randomKey(random);
+}
+
+static int compareLatency(void const *a, void const *b)
+{
+    u_int32_t const x = *(u_int32_t const *)a;
+    u_int32_t const y = *(u_int32_t const *)b;
+    return (x > y) - (x < y);
+}
+
+static u_int32_t latencyPercentile(u_int32_t const *const sorted, unsigned long const count, double const percentile)
+{
+    unsigned long index = (unsigned long)(percentile / 100.0 * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+// Checksum of the playfield and the score, so that two runs with the same
+// settings can be compared at a glance
+static u_int64_t stateChecksum()
+{
+    u_int64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char const *bytes = (unsigned char const *)game.colors;
+    for (size_t i = 0; i < game.grid.x * game.grid.y * sizeof(u_int16_t); i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    unsigned int const stats[] = {game.state, game.games, game.tiles, game.rows, game.score, game.level};
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        hash = (hash ^ stats[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline u_int64_t nSecFromTimespec(struct timespec const ts)
+{
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void writeVarint(FILE *const file, u_int64_t value)
+{
+    while (value >= 0x80)
+    {
+        fputc((int)(value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int)value, file);
+}
+
+static bool readVarint(unsigned char const **const cursor, unsigned char const *const end, u_int64_t *const value)
+{
+    u_int64_t result = 0;
+    for (unsigned int shift = 0; shift < 64 && *cursor < end; shift += 7)
+    {
+        unsigned char const byte = *(*cursor)++;
+        result |= (u_int64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void writeRecordHeader(unsigned int const type)
+{
+    writeVarint(session_recorder.file, (u_int64_t)(session_recorder.step - session_recorder.lastStep) << 3 | type);
+    session_recorder.lastStep = session_recorder.step;
+}
+
+// Everything sTetris() depends on, so a replay can start from here
+static void writeSnapshot(FILE *const file)
+{
+    u_int64_t const fields[] = {game.state, game.games, game.tiles, game.rows, game.score, game.level,
+                                game.colorIndex, game.activeTile.x, game.activeTile.y, game.tick, game.nextGameTick};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        writeVarint(file, fields[i]);
+    }
+    for (unsigned int y = 0; y < game.grid.y; y++)
+    {
+        writeVarint(file, game.occupied[y]);
+    }
+    for (unsigned int i = 0; i < game.grid.x * game.grid.y; i++)
+    {
+        writeVarint(file, game.colors[i]);
+    }
+}
+
+// Reads a snapshot into the game, or only checks that it matches the game
+static bool readSnapshot(unsigned char const **const cursor, unsigned char const *const end, bool const restore, bool *const matches)
+{
+    u_int64_t fields[11];
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        if (!readVarint(cursor, end, &fields[i]))
+            return false;
+    }
+    *matches = fields[0] == game.state && fields[1] == game.games && fields[2] == game.tiles &&
+               fields[3] == game.rows && fields[4] == game.score && fields[5] == game.level &&
+               fields[6] == game.colorIndex && fields[7] == game.activeTile.x &&
+               fields[8] == game.activeTile.y && fields[9] == game.tick && fields[10] == game.nextGameTick;
+    if (restore)
+    {
+        game.state = fields[0];
+        game.games = fields[1];
+        game.tiles = fields[2];
+        game.rows = fields[3];
+        game.score = fields[4];
+        game.level = fields[5];
+        game.colorIndex = fields[6];
+        game.activeTile.x = fields[7];
+        game.activeTile.y = fields[8];
+        game.tick = fields[9];
+        game.nextGameTick = fields[10];
+    }
+
+    for (unsigned int y = 0; y < game.grid.y; y++)
+    {
+        u_int64_t row;
+        if (!readVarint(cursor, end, &row))
+            return false;
+        *matches = *matches && row == game.occupied[y];
+        if (restore)
+            game.occupied[y] = row;
+    }
+    for (unsigned int i = 0; i < game.grid.x * game.grid.y; i++)
+    {
+        u_int64_t color;
+        if (!readVarint(cursor, end, &color))
+            return false;
+        *matches = *matches && color == game.colors[i];
+        if (restore)
+            game.colors[i] = color;
+    }
+    return true;
+}
+
+static bool startRecording(u_int64_t const seed)
+{
+    session_recorder.file = fopen(session_recorder.path, "wb");
+    if (!session_recorder.file)
+    {
+        fprintf(stderr, "ERROR: could not create session log %s\n", session_recorder.path);
+        return false;
+    }
+    fwrite(SESSION_MAGIC, 1, strlen(SESSION_MAGIC), session_recorder.file);
+    fputc(SESSION_VERSION, session_recorder.file);
+    writeVarint(session_recorder.file, game.grid.x);
+    writeVarint(session_recorder.file, game.grid.y);
+    writeVarint(session_recorder.file, seed);
+    session_recorder.step = 0;
+    session_recorder.lastStep = 0;
+    return true;
+}
+
+// Called with the key of every step, before it is played
+static void recordStep(int const key)
+{
+    if (!session_recorder.file)
+        return;
+
+    if (session_recorder.step && session_recorder.step % SESSION_SNAPSHOT_INTERVAL == 0)
+    {
+        writeRecordHeader(SESSION_SNAPSHOT);
+        writeSnapshot(session_recorder.file);
+    }
+    if (key)
+    {
+        switch (key)
+        {
+        case KEY_LEFT:
+            writeRecordHeader(SESSION_KEY_LEFT);
+            break;
+        case KEY_RIGHT:
+            writeRecordHeader(SESSION_KEY_RIGHT);
+            break;
+        case KEY_DOWN:
+            writeRecordHeader(SESSION_KEY_DOWN);
+            break;
+        default:
+            writeRecordHeader(SESSION_KEY_OTHER);
+        }
+    }
+    session_recorder.step++;
+}
+
+static void stopRecording()
+{
+    if (!session_recorder.file)
+        return;
+
+    writeRecordHeader(SESSION_END);
+    u_int64_t const stats[] = {game.state, game.games, game.tiles, game.rows, game.score, game.level, stateChecksum()};
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        writeVarint(session_recorder.file, stats[i]);
+    }
+    if (fclose(session_recorder.file) != 0)
+        fprintf(stderr, "ERROR: could not write session log %s\n", session_recorder.path);
+    session_recorder.file = NULL;
+}
+
+static inline void playStep(int const key)
+{
+    sTetris(&game, key);
+    game.tick = (game.tick + 1) % game.nextGameTick;
+}
+
+// Takes the grid of the playfield from the header of a session log, so that
+// it can be allocated before the replay. A grid given on the command line
+// has to match the recorded one.
+static bool readSessionGrid(char const *const path, bool const hasGrid)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "ERROR: could not open session log %s\n", path);
+        return false;
+    }
+    // The magic, the version and two varints of at most 10 bytes
+    unsigned char header[32];
+    size_t const length = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    size_t const magicLength = strlen(SESSION_MAGIC);
+    unsigned char const *cursor = header + magicLength + 1;
+    u_int64_t width, height;
+    if (length < magicLength + 1 || memcmp(header, SESSION_MAGIC, magicLength) || header[magicLength] != SESSION_VERSION ||
+        !readVarint(&cursor, header + length, &width) || !readVarint(&cursor, header + length, &height))
+    {
+        fprintf(stderr, "ERROR: %s is not a session log\n", path);
+        return false;
+    }
+    if (hasGrid && (width != game.grid.x || height != game.grid.y))
+    {
+        fprintf(stderr, "ERROR: %s was recorded on a %" PRIu64 "x%" PRIu64 " grid, not %ux%u\n",
+                path, width, height, game.grid.x, game.grid.y);
+        return false;
+    }
+    if (width > MAX_GRID_WIDTH || height > UINT32_MAX)
+    {
+        fprintf(stderr, "ERROR: %s was recorded on a grid that is too large\n", path);
+        return false;
+    }
+    game.grid.x = width;
+    game.grid.y = height;
+    return true;
+}
+
+// Plays a recorded session back through sTetris() as fast as it goes and
+// verifies the final stats against the recording. With a seek step, playing
+// starts from the last snapshot before it and stops there instead.
+static int runReplay(headless_t const *const headless)
+{
+    FILE *file = fopen(headless->replayPath, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "ERROR: could not open session log %s\n", headless->replayPath);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long const size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = (unsigned char *)malloc(size > 0 ? size : 1);
+    bool const loaded = data && size > 0 && fread(data, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    unsigned char const *cursor = data;
+    unsigned char const *const end = data + (loaded ? size : 0);
+    size_t const magicLength = strlen(SESSION_MAGIC);
+    u_int64_t width, height, seed;
+    if (!loaded || size < (long)magicLength + 1 || memcmp(data, SESSION_MAGIC, magicLength) ||
+        data[magicLength] != SESSION_VERSION)
+    {
+        fprintf(stderr, "ERROR: %s is not a session log\n", headless->replayPath);
+        free(data);
+        return 1;
+    }
+    cursor += magicLength + 1;
+    if (!readVarint(&cursor, end, &width) || !readVarint(&cursor, end, &height) || !readVarint(&cursor, end, &seed) ||
+        width != game.grid.x || height != game.grid.y)
+    {
+        fprintf(stderr, "ERROR: %s was recorded on a different grid\n", headless->replayPath);
+        free(data);
+        return 1;
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Find the last snapshot at or before the seek step. Records are only
+    // decoded here, nothing is played.
+    unsigned long step = 0;
+    unsigned char const *resume = cursor;
+    unsigned long resumeStep = 0;
+    if (headless->hasSeek)
+    {
+        unsigned char const *scan = cursor;
+        unsigned long scanStep = 0;
+        u_int64_t header;
+        while (readVarint(&scan, end, &header))
+        {
+            scanStep += header >> 3;
+            unsigned int const type = header & 7;
+            if (type == SESSION_END || scanStep > headless->seek)
+                break;
+            if (type == SESSION_SNAPSHOT)
+            {
+                bool matches;
+                unsigned char const *snapshot = scan;
+                if (!readSnapshot(&scan, end, false, &matches))
+                    break;
+                resume = snapshot;
+                resumeStep = scanStep;
+            }
+        }
+    }
+    if (resumeStep)
+    {
+        bool matches;
+        cursor = resume;
+        readSnapshot(&cursor, end, true, &matches);
+        step = resumeStep;
+    }
+    unsigned long const played = step;
+    unsigned long lastRecord = step;
+
+    bool ended = false;
+    bool valid = true;
+    unsigned int snapshots = 0;
+    unsigned int badSnapshots = 0;
+    u_int64_t expected[7];
+    u_int64_t header;
+    while (!ended && valid && readVarint(&cursor, end, &header))
+    {
+        // Steps without a record are played without input
+        unsigned long const recordStep = lastRecord + (header >> 3);
+        lastRecord = recordStep;
+        unsigned long const stopStep = headless->hasSeek && headless->seek < recordStep ? headless->seek : recordStep;
+        for (; step < stopStep; step++)
+        {
+            playStep(0);
+        }
+        if (step != recordStep)
+            break;
+        if (headless->hasSeek && step == headless->seek && (header & 7) != SESSION_END)
+            break;
+
+        bool matches;
+        switch (header & 7)
+        {
+        case SESSION_SNAPSHOT:
+            valid = readSnapshot(&cursor, end, false, &matches);
+            snapshots++;
+            badSnapshots += !matches;
+            break;
+        case SESSION_KEY_LEFT:
+            playStep(KEY_LEFT);
+            step++;
+            break;
+        case SESSION_KEY_RIGHT:
+            playStep(KEY_RIGHT);
+            step++;
+            break;
+        case SESSION_KEY_DOWN:
+            playStep(KEY_DOWN);
+            step++;
+            break;
+        case SESSION_KEY_OTHER:
+            playStep(KEY_UP);
+            step++;
+            break;
+        case SESSION_END:
+            for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]) && valid; i++)
+            {
+                valid = readVarint(&cursor, end, &expected[i]);
+            }
+            ended = valid;
+            break;
+        default:
+            valid = false;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double const seconds = (nSecFromTimespec(finish) - nSecFromTimespec(start)) / 1e9;
+    free(data);
+
+    printf("Session:     %s (seed %" PRIu64 ")\n", headless->replayPath, seed);
+    if (played)
+        printf("Resumed:     snapshot at step %lu\n", played);
+    printf("Steps:       %lu\n", step);
+    printf("Games:       %u\n", game.games);
+    printf("Last game:   %s, %u tiles, %u rows, score %u, level %u\n",
+           (game.state & ACTIVE) ? "running" : "over", game.tiles, game.rows, game.score, game.level);
+    printf("Checksum:    %016" PRIx64 "\n", stateChecksum());
+    printf("Elapsed:     %.3f ms\n", seconds * 1e3);
+    printf("Throughput:  %.0f steps/s\n", seconds > 0 ? (step - played) / seconds : 0.0);
+
+    if (headless->hasSeek && !ended)
+    {
+        if (step != headless->seek)
+        {
+            fprintf(stderr, "ERROR: the session ends before step %lu\n", headless->seek);
+            return 1;
+        }
+        return 0;
+    }
+    if (!ended)
+    {
+        fprintf(stderr, "ERROR: %s is truncated or corrupt\n", headless->replayPath);
+        return 1;
+    }
+
+    bool const same = expected[0] == game.state && expected[1] == game.games && expected[2] == game.tiles &&
+                      expected[3] == game.rows && expected[4] == game.score && expected[5] == game.level &&
+                      expected[6] == stateChecksum() && badSnapshots == 0;
+    if (same)
+        printf("Verified:    score, rows, tiles and %u snapshots match the recording\n", snapshots);
+    else
+        printf("Verified:    MISMATCH, recorded %" PRIu64 " tiles, %" PRIu64 " rows, score %" PRIu64
+               ", %u of %u snapshots differ\n",
+               expected[2], expected[3], expected[4], badSnapshots, snapshots);
+    return same ? 0 : 1;
+}
+
+// Runs the game without the Sense HAT or a terminal, stepping the engine as
+// fast as it goes, and reports the throughput and the time taken per tick
+static int runHeadless(headless_t *const headless)
 {
-    (void)argc;
-    (void)argv;
-    // This sets the stdin in a special state where each
-    // keyboard press is directly flushed to the stdin and additionally
-    // not outputted to the stdout
+    if (headless->scriptPath && !loadScript(headless))
     {
-        struct termios ttystate;
-        tcgetattr(STDIN_FILENO, &ttystate);
-        ttystate.c_lflag &= ~(ICANON | ECHO);
-        ttystate.c_cc[VMIN] = 1;
-        tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
+        free(headless->script);
+        return 1;
+    }
+    if (headless->ticks == 0)
+    {
+        headless->ticks = headless->script ? headless->scriptLength : 1000000;
     }
 
-    // Allocate the playing field structure
-    game.rawPlayfield = (tile *)malloc(game.grid.x * game.grid.y * sizeof(tile));
-    game.playfield = (tile **)malloc(game.grid.y * sizeof(tile *));
-    if (!game.playfield || !game.rawPlayfield)
+    u_int32_t *latencies = (u_int32_t *)malloc(headless->ticks * sizeof(u_int32_t));
+    if (!latencies)
     {
-        fprintf(stderr, "ERROR: could not allocate playfield\n");
+        fprintf(stderr, "ERROR: could not allocate latency samples\n");
+        free(headless->script);
         return 1;
     }
-    for (unsigned int y = 0; y < game.grid.y; y++)
+
+    u_int64_t random = headless->seed ? headless->seed : 1;
+    if (session_recorder.path && !startRecording(headless->seed))
+    {
+        free(latencies);
+        free(headless->script);
+        return 1;
+    }
+
+    struct timespec start, before, after;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    after = start;
+    for (unsigned long i = 0; i < headless->ticks; i++)
+    {
+        int const key = nextHeadlessKey(headless, i, &random);
+        recordStep(key);
+
+        before = after;
+        bool const playfieldChanged = sTetris(&game, key);
+        if (sensehat_ctl.pixels)
+            renderSenseHatMatrix(playfieldChanged);
+        clearDirtyTiles();
+        game.tick = (game.tick + 1) % game.nextGameTick;
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        latencies[i] = (u_int32_t)(nSecFromTimespec(after) - nSecFromTimespec(before));
+    }
+    double const seconds = (nSecFromTimespec(after) - nSecFromTimespec(start)) / 1e9;
+    stopRecording();
+
+    qsort(latencies, headless->ticks, sizeof(u_int32_t), compareLatency);
+
+    if (headless->script)
+        printf("Script:      %s (%zu ticks)\n", headless->scriptPath, headless->scriptLength);
+    else
+        printf("Seed:        %" PRIu64 "\n", headless->seed);
+    printf("Ticks:       %lu\n", headless->ticks);
+    printf("Games:       %u\n", game.games);
+    printf("Last game:   %s, %u tiles, %u rows, score %u, level %u\n",
+           (game.state & ACTIVE) ? "running" : "over", game.tiles, game.rows, game.score, game.level);
+    printf("Checksum:    %016" PRIx64 "\n", stateChecksum());
+    printf("Elapsed:     %.3f s\n", seconds);
+    printf("Throughput:  %.0f ticks/s\n", seconds > 0 ? headless->ticks / seconds : 0.0);
+    printf("Tick time:   p50 %u ns, p90 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+           latencyPercentile(latencies, headless->ticks, 50),
+           latencyPercentile(latencies, headless->ticks, 90),
+           latencyPercentile(latencies, headless->ticks, 99),
+           latencyPercentile(latencies, headless->ticks, 99.9),
+           latencies[headless->ticks - 1]);
+
+    free(latencies);
+    free(headless->script);
+    return 0;
+}
+
+// Seeds the key stream of a board, so that every board plays differently
+static u_int64_t boardSeed(u_int64_t const seed, unsigned int const board)
+{
+    u_int64_t z = seed + (board + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+static void freeBatch(board_batch_t *const batch)
+{
+    free(batch->occupied);
+    free(batch->state);
+    free(batch->games);
+    free(batch->tiles);
+    free(batch->rows);
+    free(batch->score);
+    free(batch->level);
+    free(batch->tick);
+    free(batch->nextGameTick);
+    free(batch->activeTile);
+    free(batch->rowFull);
+    free(batch->random);
+    free(batch->keys);
+}
+
+// Like calloc(), but the array starts on a cache line and its size is
+// rounded up to whole cache lines
+static void *allocateBatchArray(size_t const count, size_t const size)
+{
+    size_t const bytes = (count * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    void *const array = aligned_alloc(CACHE_LINE, bytes ? bytes : CACHE_LINE);
+    if (array)
+        memset(array, 0, bytes);
+    return array;
+}
+
+// Allocates a batch of boards that all start out in the game over state,
+// just like the interactive game
+static bool allocateBatch(board_batch_t *const batch, gameConfig const *const rules, unsigned int const count, u_int64_t const seed)
+{
+    batch->rules = rules;
+    batch->count = count;
+    batch->stride = (count + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    batch->occupied = (row_bits *)allocateBatchArray((size_t)rules->grid.y * batch->stride, sizeof(row_bits));
+    batch->state = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->games = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->tiles = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->rows = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->score = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->level = (unsigned int *)allocateBatchArray(count, sizeof(unsigned int));
+    batch->tick = (unsigned long *)allocateBatchArray(count, sizeof(unsigned long));
+    batch->nextGameTick = (unsigned long *)allocateBatchArray(count, sizeof(unsigned long));
+    batch->activeTile = (coord *)allocateBatchArray(count, sizeof(coord));
+    batch->rowFull = (u_int8_t *)allocateBatchArray(count, sizeof(u_int8_t));
+    batch->random = (u_int64_t *)allocateBatchArray(count, sizeof(u_int64_t));
+    batch->keys = (int *)allocateBatchArray(count, sizeof(int));
+    if (!batch->occupied || !batch->state || !batch->games || !batch->tiles || !batch->rows ||
+        !batch->score || !batch->level || !batch->tick || !batch->nextGameTick ||
+        !batch->activeTile || !batch->rowFull || !batch->random || !batch->keys)
+    {
+        return false;
+    }
+
+    for (unsigned int b = 0; b < count; b++)
+    {
+        batch->state[b] = GAMEOVER;
+        batch->nextGameTick[b] = rules->initNextGameTick;
+        batch->random[b] = boardSeed(seed, b);
+    }
+    return true;
+}
+
+static inline bool batchTileOccupied(board_batch_t const *const batch, unsigned int const b, coord const target)
+{
+    return (batch->occupied[target.y * batch->stride + b] >> target.x) & 1;
+}
+
+// Moves whatever is at the active tile, like copyTile() and resetTile() do
+static inline bool batchMoveTile(board_batch_t *const batch, unsigned int const b, int const dx, int const dy)
+{
+    coord const from = batch->activeTile[b];
+    coord const to = {from.x + dx, from.y + dy};
+    if ((dx < 0 && from.x == 0) || (dx > 0 && from.x >= batch->rules->grid.x - 1) ||
+        (dy > 0 && from.y >= batch->rules->grid.y - 1) || batchTileOccupied(batch, b, to))
+    {
+        return false;
+    }
+
+    row_bits *const fromRow = &batch->occupied[from.y * batch->stride + b];
+    row_bits const bit = (*fromRow >> from.x) & 1;
+    *fromRow &= ~((row_bits)1 << from.x);
+    batch->occupied[to.y * batch->stride + b] |= bit << to.x;
+    batch->activeTile[b] = to;
+    return true;
+}
+
+static inline bool batchAddNewTile(board_batch_t *const batch, unsigned int const b)
+{
+    coord const target = {(batch->rules->grid.x - 1) / 2, 0};
+    batch->activeTile[b] = target;
+    if (batchTileOccupied(batch, b, target))
+        return false;
+    batch->occupied[b] |= (row_bits)1 << target.x;
+    return true;
+}
+
+static inline void batchDropBottomRow(board_batch_t *const batch, unsigned int const b)
+{
+    unsigned int const stride = batch->stride;
+    for (unsigned int y = batch->rules->grid.y - 1; y > 0; y--)
+    {
+        batch->occupied[y * stride + b] = batch->occupied[(y - 1) * stride + b];
+    }
+    batch->occupied[b] = 0;
+}
+
+static inline void batchNewGame(board_batch_t *const batch, unsigned int const b)
+{
+    batch->state[b] = ACTIVE;
+    batch->games[b]++;
+    batch->tiles[b] = 0;
+    batch->rows[b] = 0;
+    batch->score[b] = 0;
+    batch->tick[b] = 0;
+    batch->level[b] = 0;
+    for (unsigned int y = 0; y < batch->rules->grid.y; y++)
+    {
+        batch->occupied[y * batch->stride + b] = 0;
+    }
+}
+
+// Steps boards [begin, end) of the batch by one tick with the given keys,
+// which is what sTetris() followed by advancing the tick does for a single
+// board. The input is applied to every board first, so the row checks can
+// then run over the contiguous bottom rows of all boards at once.
+static void stepBatch(board_batch_t *const batch, int const *const keys, unsigned int const begin, unsigned int const end)
+{
+    for (unsigned int b = begin; b < end; b++)
+    {
+        if (!(batch->state[b] & ACTIVE))
+            continue;
+        switch (keys[b])
+        {
+        case KEY_LEFT:
+            batchMoveTile(batch, b, -1, 0);
+            break;
+        case KEY_RIGHT:
+            batchMoveTile(batch, b, 1, 0);
+            break;
+        case KEY_DOWN:
+            while (batchMoveTile(batch, b, 0, 1))
+            {
+            }
+            batch->tick[b] = 0;
+            break;
+        }
+    }
+
+    // Branch free, so the compiler vectorizes it
+    row_bits const *const bottom = &batch->occupied[(batch->rules->grid.y - 1) * batch->stride];
+    row_bits const fullRow = batch->rules->fullRow;
+    for (unsigned int b = begin; b < end; b++)
+    {
+        batch->rowFull[b] = bottom[b] == fullRow;
+    }
+
+    for (unsigned int b = begin; b < end; b++)
+    {
+        if ((batch->state[b] & ACTIVE) && batch->tick[b] == 0)
+        {
+            batch->state[b] &= ~(ROW_CLEAR | TILE_ADDED);
+            if (batch->rowFull[b])
+            {
+                batchDropBottomRow(batch, b);
+                batch->state[b] |= ROW_CLEAR;
+                batch->rows[b]++;
+                batch->score[b] += batch->level[b] + 1;
+                if ((batch->rows[b] % batch->rules->rowsPerLevel) == 0)
+                {
+                    batch->level[b]++;
+                    batch->nextGameTick[b] = fasterGameTick(batch->nextGameTick[b]);
+                }
+            }
+
+            if (!batchTileOccupied(batch, b, batch->activeTile[b]) || !batchMoveTile(batch, b, 0, 1))
+            {
+                if (batchAddNewTile(batch, b))
+                {
+                    batch->state[b] |= TILE_ADDED;
+                    batch->tiles[b]++;
+                }
+                else
+                {
+                    batch->state[b] = GAMEOVER;
+                    batch->nextGameTick[b] = batch->rules->initNextGameTick;
+                }
+            }
+        }
+
+        if (batch->state[b] == GAMEOVER && keys[b])
+        {
+            batchNewGame(batch, b);
+            batchAddNewTile(batch, b);
+            batch->state[b] |= TILE_ADDED;
+            batch->tiles[b]++;
+        }
+
+        batch->tick[b] = (batch->tick[b] + 1) % batch->nextGameTick[b];
+    }
+}
+
+// Plays the generated key streams of one slice of the batch
+static void *runBatchWorker(void *arg)
+{
+    batch_worker_t *const worker = (batch_worker_t *)arg;
+    board_batch_t *const batch = worker->batch;
+    for (unsigned long step = 0; step < worker->steps; step++)
     {
-        game.playfield[y] = &(game.rawPlayfield[y * game.grid.x]);
+        for (unsigned int b = worker->begin; b < worker->end; b++)
+        {
+            batch->keys[b] = randomKey(&batch->random[b]);
+        }
+        stepBatch(batch, batch->keys, worker->begin, worker->end);
+    }
+    return NULL;
+}
+
+// Replays the key stream of a batch board through sTetris() on a board of
+// its own, and checks that both end up in the same state
+static bool verifyBatchBoard(board_batch_t const *const batch, unsigned int const b, u_int64_t const seed, unsigned long const steps)
+{
+    gameConfig board = {
+        .grid = batch->rules->grid,
+        .uSecTickTime = batch->rules->uSecTickTime,
+        .rowsPerLevel = batch->rules->rowsPerLevel,
+        .initNextGameTick = batch->rules->initNextGameTick,
+        .fullRow = batch->rules->fullRow,
+    };
+    board.occupied = (row_bits *)malloc(board.grid.y * sizeof(row_bits));
+    board.colors = (u_int16_t *)malloc(board.grid.x * board.grid.y * sizeof(u_int16_t));
+    if (!board.occupied || !board.colors)
+    {
+        free(board.occupied);
+        free(board.colors);
+        return false;
+    }
+    resetPlayfield(&board);
+    gameOver(&board);
+
+    u_int64_t random = boardSeed(seed, b);
+    for (unsigned long step = 0; step < steps; step++)
+    {
+        sTetris(&board, randomKey(&random));
+        board.tick = (board.tick + 1) % board.nextGameTick;
+    }
+
+    bool same = board.state == batch->state[b] && board.games == batch->games[b] &&
+                board.tiles == batch->tiles[b] && board.rows == batch->rows[b] &&
+                board.score == batch->score[b] && board.level == batch->level[b] &&
+                board.tick == batch->tick[b] && board.nextGameTick == batch->nextGameTick[b] &&
+                board.activeTile.x == batch->activeTile[b].x && board.activeTile.y == batch->activeTile[b].y;
+    for (unsigned int y = 0; y < board.grid.y; y++)
+    {
+        same = same && board.occupied[y] == batch->occupied[y * batch->stride + b];
+    }
+
+    free(board.occupied);
+    free(board.colors);
+    return same;
+}
+
+// Steps a batch of boards from generated key streams on worker threads, one
+// slice of boards each, and reports the aggregate step rate. A few boards
+// are then checked against sTetris().
+static int runBatch(headless_t *const headless)
+{
+    if (headless->scriptPath || session_recorder.path)
+    {
+        fprintf(stderr, "ERROR: a batch plays generated keys and is not recorded\n");
+        return 1;
+    }
+    unsigned long const steps = headless->ticks ? headless->ticks : 10000;
+    unsigned int const count = headless->boards;
+    unsigned int threads = headless->threads;
+    if (threads == 0)
+    {
+        long const online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    if (threads > count)
+        threads = count;
+
+    board_batch_t batch = {0};
+    batch_worker_t *workers = (batch_worker_t *)calloc(threads, sizeof(batch_worker_t));
+    if (!workers || !allocateBatch(&batch, &game, count, headless->seed))
+    {
+        fprintf(stderr, "ERROR: could not allocate %u boards\n", count);
+        freeBatch(&batch);
+        free(workers);
+        return 1;
+    }
+
+    // The arrays and playfield rows start on a cache line and slices are whole
+    // multiples of a cache line even for the byte sized arrays, so threads
+    // don't share lines
+    unsigned int const align = CACHE_LINE;
+    unsigned int const slice = ((count + threads - 1) / threads + align - 1) / align * align;
+    threads = (count + slice - 1) / slice;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        workers[t].batch = &batch;
+        workers[t].begin = t * slice < count ? t * slice : count;
+        workers[t].end = (t + 1) * slice < count ? (t + 1) * slice : count;
+        workers[t].steps = steps;
+        workers[t].joinable = pthread_create(&workers[t].thread, NULL, runBatchWorker, &workers[t]) == 0;
+        if (!workers[t].joinable)
+            runBatchWorker(&workers[t]);
+    }
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        if (workers[t].joinable)
+            pthread_join(workers[t].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double const seconds = (nSecFromTimespec(end) - nSecFromTimespec(start)) / 1e9;
+
+    unsigned long games = 0;
+    unsigned long rows = 0;
+    for (unsigned int b = 0; b < count; b++)
+    {
+        games += batch.games[b];
+        rows += batch.rows[b];
+    }
+
+    unsigned int const checked = count < 4 ? count : 4;
+    unsigned int mismatch = count;
+    for (unsigned int i = 0; i < checked && mismatch == count; i++)
+    {
+        // The first and last boards, and a couple in between
+        unsigned int const b = (unsigned long)i * (count - 1) / (checked > 1 ? checked - 1 : 1);
+        if (!verifyBatchBoard(&batch, b, headless->seed, steps))
+            mismatch = b;
+    }
+
+    printf("Seed:        %" PRIu64 "\n", headless->seed);
+    printf("Boards:      %u\n", count);
+    printf("Threads:     %u\n", threads);
+    printf("Steps:       %lu per board\n", steps);
+    printf("Games:       %lu\n", games);
+    printf("Rows:        %lu in the running games\n", rows);
+    printf("Elapsed:     %.3f s\n", seconds);
+    printf("Throughput:  %.0f steps/s\n", seconds > 0 ? (double)count * steps / seconds : 0.0);
+    if (mismatch == count)
+        printf("Verified:    %u boards match sTetris()\n", checked);
+    else
+        printf("Verified:    board %u does not match sTetris()\n", mismatch);
+
+    freeBatch(&batch);
+    free(workers);
+    return mismatch == count ? 0 : 1;
+}
+
+static void printUsage(char const *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--fb PATH | --virtual-fb WxH[:FILE]] [--joystick PATH] [--grid WxH] [--record FILE]\n"
+            "       %s [--headless] [--virtual-fb WxH[:FILE]] [--grid WxH] [--seed N] [--ticks N]\n"
+            "          [--script FILE] [--record FILE]\n"
+            "       %s --batch N [--threads N] [--seed N] [--ticks N]\n"
+            "       %s --replay FILE [--seek STEP]\n"
+            "  --fb PATH        framebuffer to draw on instead of looking up the Sense HAT\n"
+            "  --virtual-fb WxH[:FILE]\n"
+            "                   draw on a W by H pixel framebuffer in FILE, or in memory,\n"
+            "                   instead of the Sense HAT (the joystick is then optional)\n"
+            "  --joystick PATH  input device to read instead of looking up the Sense HAT\n"
+            "  --grid WxH       playfield size (default 8x8, at most 64 wide)\n"
+            "  --record FILE    record the keys of the session to FILE\n"
+            "  --headless       run without the Sense HAT and terminal as fast as possible\n"
+            "  --seed N         seed of the generated key stream (default 1)\n"
+            "  --ticks N        number of ticks to run (default 1000000, or the script length)\n"
+            "  --script FILE    play keys from FILE: l, r, d, u or . per tick\n"
+            "  --batch N        step N boards at once (default 10000 ticks)\n"
+            "  --threads N      worker threads of a batch (default: one per core)\n"
+            "  --replay FILE    play a recorded session on its grid and verify its final stats\n"
+            "  --seek STEP      stop the replay at STEP, starting from the nearest snapshot\n"
+            "The options after --headless imply it.\n",
+            program, program, program, program);
+}
+
+int main(int argc, char **argv)
+{
+    headless_t headless = {0};
+    headless.seed = 1;
+    bool hasGrid = false;
+    for (int i = 1; i < argc; i++)
+    {
+        bool const hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--headless"))
+        {
+            headless.enabled = true;
+        }
+        else if (!strcmp(argv[i], "--seed") && hasValue)
+        {
+            headless.enabled = true;
+            headless.seed = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--ticks") && hasValue)
+        {
+            headless.enabled = true;
+            headless.ticks = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--script") && hasValue)
+        {
+            headless.enabled = true;
+            headless.scriptPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--fb") && hasValue)
+        {
+            sensehat_ctl.devicePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--joystick") && hasValue)
+        {
+            sensehat_joystick.devicePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--virtual-fb") && hasValue)
+        {
+            // WIDTHxHEIGHT, optionally followed by :FILE
+            char *rest;
+            virtual_fb.enabled = true;
+            virtual_fb.width = strtoul(argv[++i], &rest, 10);
+            virtual_fb.height = *rest == 'x' ? strtoul(rest + 1, &rest, 10) : 0;
+            virtual_fb.path = *rest == ':' ? rest + 1 : NULL;
+        }
+        else if (!strcmp(argv[i], "--grid") && hasValue)
+        {
+            char *rest;
+            game.grid.x = strtoul(argv[++i], &rest, 10);
+            game.grid.y = *rest == 'x' ? strtoul(rest + 1, NULL, 10) : 0;
+            hasGrid = true;
+        }
+        else if (!strcmp(argv[i], "--record") && hasValue)
+        {
+            session_recorder.path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--replay") && hasValue)
+        {
+            headless.enabled = true;
+            headless.replayPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--seek") && hasValue)
+        {
+            headless.enabled = true;
+            headless.hasSeek = true;
+            headless.seek = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--batch") && hasValue)
+        {
+            headless.enabled = true;
+            headless.boards = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "--threads") && hasValue)
+        {
+            headless.enabled = true;
+            headless.threads = strtoul(argv[++i], NULL, 0);
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // A replay plays on the grid it was recorded on
+    if (headless.replayPath && !readSessionGrid(headless.replayPath, hasGrid))
+        return 1;
+
+    // Allocate the playing field structure
+    if (!allocatePlayfield())
+    {
+        freePlayfield();
+        return 1;
     }
 
     // Reset playfield to make it empty
-    resetPlayfield();
+    resetPlayfield(&game);
     // Start with gameOver
-    gameOver();
+    gameOver(&game);
+
+    if (headless.enabled)
+    {
+        // Rendering to a virtual framebuffer is part of the measured ticks
+        if (virtual_fb.enabled && !headless.replayPath && !headless.boards)
+        {
+            if (!initializeVirtualFramebuffer())
+            {
+                freePlayfield();
+                return 1;
+            }
+            renderSenseHatMatrix(true);
+            clearDirtyTiles();
+        }
+
+        int status;
+        if (headless.replayPath)
+            status = runReplay(&headless);
+        else if (headless.boards)
+            status = runBatch(&headless);
+        else
+            status = runHeadless(&headless);
+        if (sensehat_ctl.pixels)
+            freeSenseHat();
+        freePlayfield();
+        return status;
+    }
+
+    // This sets the stdin in a special state where each
+    // keyboard press is directly flushed to the stdin and additionally
+    // not outputted to the stdout
+    {
+        struct termios ttystate;
+        tcgetattr(STDIN_FILENO, &ttystate);
+        ttystate.c_lflag &= ~(ICANON | ECHO);
+        ttystate.c_cc[VMIN] = 1;
+        tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
+    }
 
+    struct timespec startupBegin, startupEnd;
+    clock_gettime(CLOCK_MONOTONIC, &startupBegin);
     if (!initializeSenseHat())
     {
         fprintf(stderr, "ERROR: could not initilize sense hat\n");
         return 1;
     };
+    clock_gettime(CLOCK_MONOTONIC, &startupEnd);
+    printf("Sense HAT initialized in %.3f ms\n",
+           (nSecFromTimespec(startupEnd) - nSecFromTimespec(startupBegin)) / 1e6);
+
+    // SIGUSR1 dumps the latency histogram, SIGINT and SIGTERM quit cleanly
+    // so it is dumped on exit as well. Without SA_RESTART the signals wake
+    // up epoll_wait.
+    {
+        struct sigaction action = {.sa_handler = requestLatencyDump};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        action.sa_handler = requestQuit;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
 
     // Clear console, render first time
     fprintf(stdout, "\033[H\033[J");
+    fflush(stdout);
     renderConsole(true);
     renderSenseHatMatrix(true);
+    clearDirtyTiles();
+
+    // The input thread queues every press and wakes up the game, which
+    // otherwise waits on the tick timer. A press is handled the moment it
+    // arrives, and the process sleeps in epoll_wait between events.
+    int const epollfd = epoll_create1(0);
+    int const timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epollfd == -1 || timerfd == -1 || !startInputThread() ||
+        !addEpollFd(epollfd, input_thread.wakefd) ||
+        !addEpollFd(epollfd, timerfd))
+    {
+        fprintf(stderr, "ERROR: could not set up event loop\n");
+        return 1;
+    }
 
-    while (true)
+    // Interactive sessions have no seed
+    if (session_recorder.path && !startRecording(0))
     {
-        struct timeval sTv, eTv;
-        gettimeofday(&sTv, NULL);
+        return 1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline = timespecAddUSec(deadline, game.uSecTickTime);
+    armTickTimer(timerfd, deadline);
+
+    bool running = true;
+    while (running && !quitRequested)
+    {
+        if (latencyDumpRequested)
+        {
+            latencyDumpRequested = 0;
+            printInputLatency(stderr);
+        }
 
-        int key = readSenseHatJoystick();
-        if (!key)
-            key = readKeyboard();
-        if (key == KEY_ENTER)
+        struct epoll_event events[2];
+        int const count = epoll_wait(epollfd, events, 2, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
             break;
+        }
 
-        bool playfieldChanged = sTetris(key);
-        renderConsole(playfieldChanged);
-        renderSenseHatMatrix(playfieldChanged);
+        // Nothing to read if the timer was re-armed after input already
+        // took this tick
+        bool tickDue = false;
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t value;
+            bool const ready = read(events[i].data.fd, &value, sizeof(value)) == sizeof(value);
+            if (events[i].data.fd == timerfd)
+                tickDue = ready;
+        }
 
-        // Wait for next tick
-        gettimeofday(&eTv, NULL);
-        unsigned long const uSecProcessTime = ((eTv.tv_sec * 1000000) + eTv.tv_usec) - ((sTv.tv_sec * 1000000 + sTv.tv_usec));
-        if (uSecProcessTime < game.uSecTickTime)
+        // Every queued press gets a tick of its own, and takes the place of
+        // the upcoming tick, just like it used to be picked up at the start
+        // of a tick. Either way, the next tick is due one tick time after
+        // the current deadline.
+        key_event_t event;
+        while (running)
         {
-            usleep(game.uSecTickTime - uSecProcessTime);
+            bool const hasKey = popKeyEvent(&event);
+            if (!hasKey && !tickDue)
+                break;
+            int const key = hasKey ? event.key : 0;
+            if (key == KEY_ENTER)
+            {
+                running = false;
+                break;
+            }
+            tickDue = false;
+
+            recordStep(key);
+            bool playfieldChanged = sTetris(&game, key);
+            renderConsole(playfieldChanged);
+            renderSenseHatMatrix(playfieldChanged);
+            if (hasKey && event.source == INPUT_JOYSTICK && playfieldChanged)
+                recordInputLatency(event.time);
+            clearDirtyTiles();
+            game.tick = (game.tick + 1) % game.nextGameTick;
+
+            deadline = timespecAddUSec(deadline, game.uSecTickTime);
+            armTickTimer(timerfd, deadline);
         }
-        game.tick = (game.tick + 1) % game.nextGameTick;
     }
 
+    stopInputThread();
+    stopRecording();
+    close(timerfd);
+    close(epollfd);
+    printInputLatency(stderr);
     freeSenseHat();
-    free(game.playfield);
-    free(game.rawPlayfield);
+    freePlayfield();
 
     return 0;
 }